@@ -0,0 +1,43 @@
+#!/bin/bash
+# Compression benchmark: ratio and MB/s of lpaq1_stream for each model level.
+# Usage: ./bench.sh file [N] [levels]
+#     N is the memory option (default 3), levels defaults to "0 1 2 3".
+# Extra environment (PRELOAD, LOAD, ...) is passed to lpaq1_stream.
+
+set -e
+
+FILE="$1"
+MEM="${2:-3}"
+LEVELS="${3:-0 1 2 3}"
+BIN="$(dirname "$0")/lpaq1_stream"
+TMP="${TMPDIR:-/tmp}/lpaq1_bench.$$"
+
+if [ -z "$FILE" ]; then
+    echo "Usage: $0 file [N] [levels]" >&2
+    exit 1
+fi
+
+trap 'rm -f "$TMP"' EXIT
+
+SIZE=$(stat -c %s "$FILE")
+
+mbps() {
+    awk -v b="$1" -v s="$2" 'BEGIN { if (s > 0) printf "%.2f", b / 1048576 / s; else print "inf" }'
+}
+
+seconds() {
+    local start end
+    start=$(date +%s.%N)
+    "$@"
+    end=$(date +%s.%N)
+    awk -v a="$start" -v b="$end" 'BEGIN { printf "%.3f", b - a }'
+}
+
+printf "%-6s %10s %8s %10s %10s\n" level bytes ratio "c MB/s" "d MB/s"
+for L in $LEVELS; do
+    CT=$(seconds sh -c "LEVEL=$L \"$BIN\" $MEM -c < \"$FILE\" > \"$TMP\"")
+    CSIZE=$(stat -c %s "$TMP")
+    DT=$(seconds sh -c "\"$BIN\" $MEM -d < \"$TMP\" | cmp -s - \"$FILE\"")
+    RATIO=$(awk -v a="$SIZE" -v b="$CSIZE" 'BEGIN { printf "%.3f", a / b }')
+    printf "%-6s %10d %8s %10s %10s\n" $L $CSIZE $RATIO $(mbps $SIZE $CT) $(mbps $SIZE $DT)
+done
@@ -8,6 +8,10 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 
 #include "bit_predictor.h"
 
@@ -15,6 +19,7 @@
 typedef unsigned char  U8;
 typedef unsigned short U16;
 typedef unsigned int   U32;
+typedef unsigned long long U64;
 
 // Error handler: print message if any, and exit
 void quit(const char* message=0);
@@ -25,6 +30,56 @@ template <class T> void alloc(T*&p, int n) {
   if (!p) quit("out of memory");
 }
 
+// Address ranges of memory mapped persistent state files (see
+// PersistFile).  Tables moved there are released with the mapping.
+static struct Mapped {
+  const U8* lo;
+  const U8* hi;
+  Mapped* next;
+} *mapped=0;
+
+// Free an array from alloc(), or leave it if it lives in a mapped file
+void dealloc(void* p) {
+  for (Mapped* m=mapped; m; m=m->next)
+    if (p>=m->lo && p<m->hi) return;
+  free(p);
+}
+
+// An Arena hands out 64 byte aligned blocks of a persistent state file
+// in the order that persist() visits the tables of a predictor.
+// a.adopt(p, n, block) moves array p of n elements into the next block
+// and frees the old allocation block (default p).  In a fresh file the
+// block gets the current contents of p (all-zero 4 KB pages are skipped
+// to keep the file sparse); otherwise p takes over what the file holds.
+// An Arena with base NULL only adds up used().
+
+class Arena {
+  U8* base;
+  size_t size, n;
+  bool fresh;
+public:
+  Arena(U8* base, size_t size, bool fresh): base(base), size(size), n(0), fresh(fresh) {}
+  size_t used() const { return n; }
+
+  template <class T> bool adopt(T*& p, int count, void* block=0) {
+    size_t bytes=size_t(count)*sizeof(T);
+    U8* q=base+n;
+    n=n+bytes+63&~size_t(63);
+    if (!base) return false;
+    if (n>size) quit("Persistent state file is too small");
+    if (fresh) {
+      for (size_t i=0; i<bytes; i+=4096) {
+        size_t k=bytes-i<4096 ? bytes-i : 4096;
+        const U8* s=(const U8*)p+i;
+        if (s[0] || memcmp(s, s+1, k-1)) memcpy(q+i, s, k);
+      }
+    }
+    dealloc(block ? block : p);
+    p=(T*)q;
+    return true;
+  }
+};
+
 ///////////////////////////// Squash //////////////////////////////
 
 // return p = 1/(1 + exp(-d)), d scaled by 8 bits, p scaled by 12 bits
@@ -125,7 +180,7 @@ static const U8 State_table[256][2]={
 {140,252},{  0,  0},{  0,  0},{  0,  0}};  // 252
 #define nex(state,sel) State_table[state][sel]
 
-//////////////////////////// StateMap, APM //////////////////////////
+//////////////////////////// StateMap //////////////////////////
 
 // A StateMap maps a context to a probability.  Methods:
 //
@@ -134,13 +189,32 @@ static const U8 State_table[256][2]={
 //     that the next y=1, updating the previous prediction with y (0..1).
 //     limit (1..1023, default 1023) is the maximum count for computing a
 //     prediction.  Larger values are better for stationary sources.
+// sm.merge(ms, n) sets each entry to the count weighted mean of the
+//     predictions of ms[0..n-1], with their counts added (up to 1023).
+
+// dt[n] is the adaptation rate 16K/(n+1.5) of an entry with count n.
+// It is shared by all StateMaps.
+
+class DivTable {
+  int t[1024];  // i -> 16K/(i+i+3)
+public:
+  DivTable();
+  int operator[](int n) const {
+    assert(n>=0 && n<1024);
+    return t[n];
+  }
+} dt;
+
+DivTable::DivTable() {
+  for (int i=0; i<1024; ++i)
+    t[i]=16384/(i+i+3);
+}
 
 class StateMap {
 protected:
   const int N;  // Number of contexts
   int cxt;      // Context of last prediction
   U32 *t;       // cxt -> prediction in high 22 bits, count in low 10 bits
-  int dt[1024];  // i -> 16K/(i+3)
   void update(int y, int limit) {
     assert(cxt>=0 && cxt<N);
     int n=t[cxt]&1023, p=t[cxt]>>10;  // count, prediction
@@ -153,8 +227,14 @@ public:
   StateMap(const StateMap& sm);
   ~StateMap();
   const StateMap& operator= (const StateMap& sm);
-  void save(FILE* f);
+  void save(FILE* f) const;
   void load(FILE* f);
+  void save_compact(FILE* f, U32 (*initial)(int)) const;
+  void load_compact(FILE* f, U32 (*initial)(int));
+  void persist(Arena& a) { a.adopt(t, N); }
+  void save_scalars(FILE* f) const;
+  void load_scalars(FILE* f);
+  void merge(const StateMap* const* ms, int n);
 
   // update bit y (0..1), predict next bit in context cx
   int p(int y, int cx, int limit=1023) {
@@ -172,18 +252,17 @@ public:
 };
 
 
+U32 statemap_initial(int) { return 1u<<31; }
+
 StateMap::StateMap(int n): N(n), cxt(0) {
   alloc(t, N);
   for (int i=0; i<N; ++i)
-    t[i]=1<<31;
-  for (int i=0; i<1024; ++i)
-    dt[i]=16384/(i+i+3);
+    t[i]=statemap_initial(i);
 }
 
 StateMap::StateMap(const StateMap& sm) : N(sm.N), cxt(sm.cxt) {
   alloc(t, N);
   memmove(t, sm.t, N*sizeof(*t));
-  memmove(dt, sm.dt, sizeof(dt));
 }
 const StateMap& StateMap::operator= (const StateMap& sm) {
   if (&sm==this) return *this;
@@ -191,12 +270,11 @@ const StateMap& StateMap::operator= (const StateMap& sm) {
   assert(sm.N == N);
   cxt = sm.cxt;
   memmove(t, sm.t, N*sizeof(*t));
-  memmove(dt, sm.dt, sizeof(dt));
   
   return *this;
 }
 StateMap::~StateMap() {
-  free(t);
+  dealloc(t);
 }
 
 #define SIGNATURE(x) { int signature=x; fwrite(&signature, sizeof(signature), 1, f); }
@@ -208,15 +286,380 @@ StateMap::~StateMap() {
 #define DSER(x)  fread(&x, sizeof(x), 1, f);
 #define DSERN(x, n) fread(&x, sizeof(x), n, f);
 
-void StateMap::save(FILE* f) {
+// Compact state files (save_compact/load_compact) store integers as
+// LEB128 varints and tables as alternating runs: a varint count of
+// entries equal to their initial value (zero bytes, or for StateMaps
+// the value set by the constructor), then a varint count of literal
+// entries followed by them.  Untouched table regions cost a byte or two.
+
+inline void put_varint(FILE* f, U32 x) {
+  while (x>=0x80) {
+    putc(x&0x7f|0x80, f);
+    x>>=7;
+  }
+  putc(x, f);
+}
+
+inline U32 get_varint(FILE* f) {
+  U32 x=0;
+  for (int s=0; s<35; s+=7) {
+    int c=getc_unlocked(f);
+    if (c==EOF) quit("Truncated state file");
+    x|=U32(c&0x7f)<<s;
+    if (c<0x80) break;
+  }
+  return x;
+}
+
+// Zigzag coding maps small signed numbers to small unsigned ones
+inline void put_svarint(FILE* f, int x) { put_varint(f, U32(x)<<1^U32(x>>31)); }
+inline int get_svarint(FILE* f) { U32 x=get_varint(f); return int(x>>1)^-int(x&1); }
+
+// n bytes; runs of 4 or more zeros are skipped
+void put_sparse(FILE* f, const U8* p, int n) {
+  for (int i=0; i<n;) {
+    int z=i;
+    while (z<n && !p[z]) ++z;
+    int e=z, run=0;
+    while (e<n && run<4) run=p[e++] ? 0 : run+1;
+    if (run==4) e-=4;
+    put_varint(f, z-i);
+    put_varint(f, e-z);
+    fwrite(p+z, 1, e-z, f);
+    i=e;
+  }
+}
+
+void get_sparse(FILE* f, U8* p, int n) {
+  for (int i=0; i<n;) {
+    int z=get_varint(f);
+    int l=get_varint(f);
+    if (z<0 || l<0 || z>n-i || l>n-i-z) quit("Corrupt state file");
+    memset(p+i, 0, z);
+    i+=z;
+    if (fread(p+i, 1, l, f)!=l) quit("Truncated state file");
+    i+=l;
+  }
+}
+
+// n entries of t, coded as differences from initial(i); runs of 2 or
+// more unchanged entries are skipped, the rest are zigzag varints
+void put_u32s(FILE* f, const U32* t, int n, U32 (*initial)(int)) {
+  for (int i=0; i<n;) {
+    int z=i;
+    while (z<n && t[z]==initial(z)) ++z;
+    int e=z, run=0;
+    while (e<n && run<2) run=t[e]!=initial(e) ? 0 : run+1, ++e;
+    if (run==2) e-=2;
+    put_varint(f, z-i);
+    put_varint(f, e-z);
+    for (int j=z; j<e; ++j)
+      put_svarint(f, int(t[j]-initial(j)));
+    i=e;
+  }
+}
+
+void get_u32s(FILE* f, U32* t, int n, U32 (*initial)(int)) {
+  for (int i=0; i<n;) {
+    int z=get_varint(f);
+    int l=get_varint(f);
+    if (z<0 || l<0 || z>n-i || l>n-i-z) quit("Corrupt state file");
+    for (; z>0; --z, ++i) t[i]=initial(i);
+    for (; l>0; --l, ++i) t[i]=initial(i)+U32(get_svarint(f));
+  }
+}
+
+U32 zero_initial(int) { return 0; }
+
+// The compact format leaves out dt
+void StateMap::save_compact(FILE* f, U32 (*initial)(int)) const {
+  SIGNATURE(55)
+  put_varint(f, N);
+  put_varint(f, cxt);
+  put_u32s(f, t, N, initial);
+}
+void StateMap::load_compact(FILE* f, U32 (*initial)(int)) {
+  CHECKSIG(55)
+  if (get_varint(f)!=N) quit("State file does not match the model");
+  cxt=get_varint(f);
+  get_u32s(f, t, N, initial);
+}
+
+// Everything but the table, for persist()
+void StateMap::save_scalars(FILE* f) const { SER(cxt) }
+void StateMap::load_scalars(FILE* f) { DSER(cxt) }
+
+// Merge count entries of tables ts[0..n-1] into t.  Entries none of
+// them has seen are taken from ts[0].
+static void merge_statemaps(U32* t, const U32* const* ts, int n, int count) {
+  for (int i=0; i<count; ++i) {
+    U64 sum=0;
+    U32 total=0;
+    for (int k=0; k<n; ++k) {
+      U32 c=ts[k][i]&1023;
+      sum+=U64(ts[k][i]>>10)*c;
+      total+=c;
+    }
+    if (total==0) t[i]=ts[0][i];
+    else t[i]=U32(sum/total)<<10|(total<1023 ? total : 1023);
+  }
+}
+
+void StateMap::merge(const StateMap* const* ms, int n) {
+  const U32** ts=new const U32*[n];
+  for (int k=0; k<n; ++k) {
+    assert(ms[k]->N==N);
+    ts[k]=ms[k]->t;
+  }
+  merge_statemaps(t, ts, n, N);
+  delete[] ts;
+  cxt=ms[n-1]->cxt;
+}
+
+// dt is still written for compatibility with older state files
+void StateMap::save(FILE* f) const {
   SIGNATURE(55)
   SER(N) SER(cxt) SER(dt) SERN(*t, N)
 }
 void StateMap::load(FILE* f) {
+  DivTable old_dt;
   CHECKSIG(55)
-  DSERC(N) DSER(cxt) DSER(dt) DSERN(*t, N)
+  DSERC(N) DSER(cxt) DSER(old_dt) DSERN(*t, N)
+}
+
+// A StateMapSet<K> is K StateMaps of 256 contexts (bit history states)
+// stored interleaved, t[cx*S+i] for map i, so that lookups of the same
+// or nearby states by different maps share cache lines and the whole
+// set is one allocation.  ss.p(i, y, cx, limit) is sm[i].p(y, cx, limit).
+// Saved in the same format as K separate StateMaps.
+
+template <int K>
+class StateMapSet {
+  enum {N=256, S=K};  // contexts per map, row stride
+  int cxt[K];   // context of last prediction of each map
+  U32 *t;       // cx*S+i -> prediction in high 22 bits, count in low 10 bits
+public:
+  StateMapSet();
+  StateMapSet(const StateMapSet& ss);
+  ~StateMapSet();
+  const StateMapSet& operator= (const StateMapSet& ss);
+  void save(FILE* f) const;
+  void load(FILE* f);
+  void save_compact(FILE* f) const;
+  void load_compact(FILE* f);
+  void persist(Arena& a) { a.adopt(t, N*S); }
+  void save_scalars(FILE* f) const;
+  void load_scalars(FILE* f);
+  void merge(const StateMapSet* const* ss, int n);
+
+  int p(int i, int y, int cx, int limit=1023) {
+    assert(i>=0 && i<K);
+    assert(y>>1==0);
+    assert(cx>=0 && cx<N);
+    assert(limit>0 && limit<1024);
+    U32& e=t[cxt[i]*S+i];
+    int n=e&1023, p=e>>10;  // count, prediction
+    if (n<limit) ++e;
+    else e=e&0xfffffc00|limit;
+    e+=(((y<<22)-p)>>3)*dt[n]&0xfffffc00;
+    return t[(cxt[i]=cx)*S+i]>>20;
+  }
+};
+
+template <int K>
+StateMapSet<K>::StateMapSet(): t(0) {
+  alloc(t, N*S);
+  for (int i=0; i<N*S; ++i)
+    t[i]=statemap_initial(i);
+  memset(cxt, 0, sizeof(cxt));
+}
+
+template <int K>
+StateMapSet<K>::StateMapSet(const StateMapSet& ss): t(0) {
+  alloc(t, N*S);
+  memmove(t, ss.t, N*S*sizeof(*t));
+  memmove(cxt, ss.cxt, sizeof(cxt));
+}
+
+template <int K>
+const StateMapSet<K>& StateMapSet<K>::operator= (const StateMapSet& ss) {
+  if (&ss==this) return *this;
+  memmove(t, ss.t, N*S*sizeof(*t));
+  memmove(cxt, ss.cxt, sizeof(cxt));
+  return *this;
+}
+
+template <int K>
+StateMapSet<K>::~StateMapSet() {
+  dealloc(t);
+}
+
+template <int K>
+void StateMapSet<K>::save(FILE* f) const {
+  for (int i=0; i<K; ++i) {
+    SIGNATURE(55)
+    int n=N;
+    SER(n) SER(cxt[i]) SER(dt)
+    for (int j=0; j<N; ++j) SER(t[j*S+i])
+  }
+}
+
+template <int K>
+void StateMapSet<K>::load(FILE* f) {
+  DivTable old_dt;
+  for (int i=0; i<K; ++i) {
+    CHECKSIG(55)
+    DSERC(N) DSER(cxt[i]) DSER(old_dt)
+    for (int j=0; j<N; ++j) DSER(t[j*S+i])
+  }
+}
+
+template <int K>
+void StateMapSet<K>::save_compact(FILE* f) const {
+  U32 col[N];
+  for (int i=0; i<K; ++i) {
+    SIGNATURE(55)
+    put_varint(f, N);
+    put_varint(f, cxt[i]);
+    for (int j=0; j<N; ++j) col[j]=t[j*S+i];
+    put_u32s(f, col, N, statemap_initial);
+  }
+}
+
+template <int K>
+void StateMapSet<K>::load_compact(FILE* f) {
+  U32 col[N];
+  for (int i=0; i<K; ++i) {
+    CHECKSIG(55)
+    if (get_varint(f)!=N) quit("State file does not match the model");
+    cxt[i]=get_varint(f);
+    get_u32s(f, col, N, statemap_initial);
+    for (int j=0; j<N; ++j) t[j*S+i]=col[j];
+  }
+}
+
+template <int K>
+void StateMapSet<K>::save_scalars(FILE* f) const { SER(cxt) }
+template <int K>
+void StateMapSet<K>::load_scalars(FILE* f) { DSER(cxt) }
+
+// Like StateMap::merge(), the interleaved tables entry by entry
+template <int K>
+void StateMapSet<K>::merge(const StateMapSet* const* ss, int n) {
+  const U32** ts=new const U32*[n];
+  for (int k=0; k<n; ++k)
+    ts[k]=ss[k]->t;
+  merge_statemaps(t, ts, n, N*S);
+  delete[] ts;
+  memmove(cxt, ss[n-1]->cxt, sizeof(cxt));
+}
+
+//////////////////////////// DirtyMap //////////////////////////
+
+// A DirtyMap d(n) remembers which 64 byte lines of an n byte table were
+// written since the last d.clear(), e.g. so that save_delta() only writes
+// those.  The owner calls d.mark(i) when it writes byte i.  A new map is
+// off: mark() only tests a pointer until d.start() turns it on with no
+// lines marked, so tables pay for tracking only where it is used, and
+// d.stop() turns it off again.  Copying a map copies whether it is on.
+// d.save(f, t) writes the marked lines of t, d.load(f, t) reads them
+// back into t.  d.copy(t, from) copies the marked lines of from to t.
+
+class DirtyMap {
+  const int lines;  // lines in the table
+  U8* bits;         // 1 bit per line, NULL while off
+public:
+  DirtyMap(int n);
+  DirtyMap(const DirtyMap& d);
+  const DirtyMap& operator= (const DirtyMap& d);
+  ~DirtyMap();
+  void save(FILE* f, const U8* t) const;
+  void load(FILE* f, U8* t);
+  void copy(U8* t, const U8* from) const;
+  void start();
+  void stop() { free(bits); bits=0; }
+  bool on() const { return bits; }
+
+  void mark(U32 i) {
+    assert(int(i>>6)<lines);
+    if (bits) bits[i>>9]|=1<<(i>>6&7);
+  }
+  void clear() { if (bits) memset(bits, 0, lines+7>>3); }
+};
+
+DirtyMap::DirtyMap(int n): lines(n>>6), bits(0) {
+  assert(n%64==0);
+}
+
+DirtyMap::DirtyMap(const DirtyMap& d): lines(d.lines), bits(0) {
+  *this=d;
+}
+
+const DirtyMap& DirtyMap::operator= (const DirtyMap& d) {
+  if (&d==this) return *this;
+  assert(lines==d.lines);
+  if (!d.bits) {
+    stop();
+    return *this;
+  }
+  if (!bits) alloc(bits, lines+7>>3);
+  memmove(bits, d.bits, lines+7>>3);
+  return *this;
+}
+
+void DirtyMap::start() {
+  if (!bits) alloc(bits, lines+7>>3);
+  else clear();
+}
+
+DirtyMap::~DirtyMap() {
+  free(bits);
+}
+
+// Number of lines, then for each the gap from the previous one and its
+// 64 bytes
+void DirtyMap::save(FILE* f, const U8* t) const {
+  assert(bits);
+  int n=0;
+  for (int i=0; i<lines+7>>3; ++i)
+    n+=__builtin_popcount(bits[i]);
+  put_varint(f, n);
+  for (int i=0, last=0; i<lines+7>>3; ++i) {
+    if (!bits[i]) continue;
+    for (int j=0; j<8; ++j) {
+      if (!(bits[i]>>j&1)) continue;
+      int line=i*8+j;
+      put_varint(f, line-last);
+      fwrite(t+line*64, 1, 64, f);
+      last=line;
+    }
+  }
+}
+
+void DirtyMap::copy(U8* t, const U8* from) const {
+  assert(bits);
+  const int n=lines+7>>3;
+  for (int i=0; i<n; i+=8) {  // 64 lines at a time
+    U64 w=0;
+    memcpy(&w, bits+i, n-i<8 ? n-i : 8);
+    for (; w; w&=w-1) {
+      int line=i*8+__builtin_ctzll(w);
+      memmove(t+line*64, from+line*64, 64);
+    }
+  }
+}
+
+void DirtyMap::load(FILE* f, U8* t) {
+  int n=get_varint(f);
+  for (int line=0; n>0; --n) {
+    line+=get_varint(f);
+    if (line<0 || line>=lines) quit("Corrupt state file");
+    if (fread(t+line*64, 1, 64, f)!=64) quit("Truncated state file");
+  }
 }
 
+//////////////////////////// APM /////////////////////////////
+
 // An APM maps a probability and a context to a new probability.  Methods:
 //
 // APM a(n) creates with n contexts using 96*n bytes memory.
@@ -226,15 +669,37 @@ void StateMap::load(FILE* f) {
 //     with smaller ranges near the ends.  The initial output is pr.
 //     y=(0..1) is the last bit.  cx=(0..n-1) is the other context.
 //     limit=(0..1023) defaults to 255.
+// a.reset_to(b) makes a, a copy of b since updated, equal to b again,
+//     copying only the entries written since a.track_writes() or the last
+//     reset_to().
+// a.reset_to(b, &c) makes it equal to c instead, another such copy of b.
 
 class APM: public StateMap {
+  DirtyMap written;  // lines of t written since track_writes() or reset_to()
 public:
   APM(int n);
+  void track_writes(bool on=true) { if (on) written.start(); else written.stop(); }
+  void reset_to(const APM& a, const APM* c=0) {
+    written.copy((U8*)t, (const U8*)a.t);
+    if (c) {
+      c->written.copy((U8*)t, (const U8*)c->t);
+      written=c->written;
+    }
+    else written.clear();
+    cxt=(c ? c : &a)->cxt;
+  }
+  void save_compact(FILE* f) const { StateMap::save_compact(f, initial); }
+  void load_compact(FILE* f) { StateMap::load_compact(f, initial); }
+  static U32 initial(int i) {
+    int p=((i%24*2+1)*4096)/48-2048;
+    return (U32(squash(p))<<20)+6;
+  }
   int pp(int y, int pr, int cx, int limit=255) {
     assert(y>>1==0);
     assert(pr>=0 && pr<4096);
     assert(cx>=0 && cx<N/24);
     assert(limit>0 && limit<1024);
+    written.mark(cxt*sizeof(*t));
     update(y, limit);
     pr=(stretch(pr)+2048)*23;
     int wt=pr&0xfff;  // interpolation weight of next element
@@ -246,11 +711,9 @@ public:
   }
 };
 
-APM::APM(int n): StateMap(n*24) {
-  for (int i=0; i<N; ++i) {
-    int p=((i%24*2+1)*4096)/48-2048;
-    t[i]=(U32(squash(p))<<20)+6;
-  }
+APM::APM(int n): StateMap(n*24), written(n*24*sizeof(U32)) {
+  for (int i=0; i<N; ++i)
+    t[i]=initial(i);
 }
 
 //////////////////////////// Mixer /////////////////////////////
@@ -266,10 +729,16 @@ APM::APM(int n): StateMap(n*24) {
 // m.p() returns the output prediction that the next bit is 1 as a
 //     12 bit number (0 to 4095).  The normal sequence per prediction is:
 //
-// - m.add(x) called N times with input x=(-2047..2047)
+// - m.add(x) called up to N times with input x=(-2047..2047); only the
+//   first nx weights of the selected network are used and trained
 // - m.set(cxt) called once with cxt=(0..M-1)
 // - m.p() called once to predict the next bit, returns 0..4095
 // - m.update(y) called once for actual bit y=(0..1).
+//
+// m.merge(ms, n) averages the weights of ms[0..n-1] and takes the rest
+//     from ms[n-1].
+// m.save_context(f) writes what the next update() needs but the weights
+//     (inputs, selected network, output); load_context(f) reads it back.
 
 inline void train(int *t, int *w, int n, int err) {
   for (int i=0; i<n; ++i) {
@@ -296,14 +765,22 @@ public:
   Mixer(const Mixer& p);
   const Mixer& operator= (const Mixer& m);
   ~Mixer();
-  void save(FILE* f);
+  void save(FILE* f) const;
   void load(FILE* f);
+  void save_compact(FILE* f) const;
+  void load_compact(FILE* f);
+  void persist(Arena& a) { a.adopt(tx, N); a.adopt(wx, N*M); }
+  void save_scalars(FILE* f) const;
+  void load_scalars(FILE* f);
+  void save_context(FILE* f) { save_scalars(f); SERN(tx[0], N) }
+  void load_context(FILE* f) { load_scalars(f); DSERN(tx[0], N) }
+  void merge(const Mixer* const* ms, int n);
 
   // Adjust weights to minimize coding cost of last prediction
   void update(int y) {
     int err=((y<<12)-pr)*7;
     assert(err>=-32768 && err<32768);
-    train(&tx[0], &wx[cxt*N], N, err);
+    train(&tx[0], &wx[cxt*N], nx, err);
     nx=0;
   }
 
@@ -321,7 +798,7 @@ public:
 
   // predict next bit
   int p() {
-    return pr=squash(dot_product(&tx[0], &wx[cxt*N], N)>>8);
+    return pr=squash(dot_product(&tx[0], &wx[cxt*N], nx)>>8);
   }
 };
 
@@ -353,10 +830,10 @@ const Mixer& Mixer::operator= (const Mixer& m) {
   return *this;
 }
 Mixer::~Mixer() {
-  free(tx);
-  free(wx);
+  dealloc(tx);
+  dealloc(wx);
 }
-void Mixer::save(FILE* f) {
+void Mixer::save(FILE* f) const {
   SIGNATURE(56)
   SER(N) SER(M) SERN(*tx, N) SERN(*wx, N*M) SER(cxt) SER(nx) SER(pr)
 }
@@ -364,6 +841,42 @@ void Mixer::load(FILE* f) {
   CHECKSIG(56)
   DSERC(N) DSERC(M) DSERN(*tx, N) DSERN(*wx, N*M) DSER(cxt) DSER(nx) DSER(pr)
 }
+void Mixer::save_compact(FILE* f) const {
+  SIGNATURE(56)
+  put_varint(f, N);
+  put_varint(f, M);
+  for (int i=0; i<N; ++i) put_svarint(f, tx[i]);
+  for (int i=0; i<N*M; ++i) put_svarint(f, wx[i]);
+  put_varint(f, cxt);
+  put_varint(f, nx);
+  put_varint(f, pr);
+}
+void Mixer::load_compact(FILE* f) {
+  CHECKSIG(56)
+  if (get_varint(f)!=N || get_varint(f)!=M)
+    quit("State file does not match the model");
+  for (int i=0; i<N; ++i) tx[i]=get_svarint(f);
+  for (int i=0; i<N*M; ++i) wx[i]=get_svarint(f);
+  cxt=get_varint(f);
+  nx=get_varint(f);
+  pr=get_varint(f);
+}
+void Mixer::save_scalars(FILE* f) const { SER(cxt) SER(nx) SER(pr) }
+void Mixer::load_scalars(FILE* f) { DSER(cxt) DSER(nx) DSER(pr) }
+
+void Mixer::merge(const Mixer* const* ms, int n) {
+  for (int i=0; i<N*M; ++i) {
+    long long sum=0;
+    for (int k=0; k<n; ++k)
+      sum+=ms[k]->wx[i];
+    wx[i]=int(sum/n);
+  }
+  const Mixer& last=*ms[n-1];
+  memmove(tx, last.tx, N*sizeof(*tx));
+  cxt=last.cxt;
+  nx=last.nx;
+  pr=last.pr;
+}
 
 //////////////////////////// HashTable /////////////////////////
 
@@ -372,39 +885,93 @@ void Mixer::load(FILE* f) {
 // index.  The second byte is a priority (0 = empty) for hash
 // replacement.  The index need not be a hash.
 
-// HashTable<B> h(n) - create using n bytes  n and B must be 
-//     powers of 2 with n >= B*4, and B >= 2.
+// HashTable<B, N> h - create using N bytes.  N and B must be
+//     powers of 2 with N >= B*4, and B >= 2.  Both are compile time
+//     constants so the index masks fold into the lookup code.
 // h[i] returns array [1..B-1] of bytes indexed by i, creating and
 //     replacing another element if needed.  Element 0 is the
 //     checksum and should not be modified.
-
-template <int B>
+// h.prefetch(i) starts loading the cache line h[i] will look at.
+// h.dirty and h.written mark the lines h[i] returned, for save_delta()
+// and reset_to(), while they are on.
+// h.evictions counts elements in use that h[i] replaced.
+// h.resize_from(g) fills h from a table g of another size.  Growing,
+// each element of g goes to every place it could hash to in h.
+// Shrinking, the elements that land in the same slot compete, and the
+// one with the highest priority is kept.
+// h.merge(hs, n) fills h with the union of tables hs[0..n-1] of the same
+// size: of the elements in the same slot, the highest priority one.
+
+template <int B, int N>
 struct HashTable {
   U8* t;  // table: 1 element = B bytes: checksum priority data data
-  const int N;  // size in bytes
   void* orig_address;
+  DirtyMap dirty;    // lines returned since the last load or save_delta()
+  DirtyMap written;  // lines returned since the copy or reset_to()
+  U32 evictions;
 public:
-  HashTable(int n);
+  HashTable();
   HashTable(const HashTable &t);
   const HashTable& operator= (const HashTable& c);
   ~HashTable();
-  void save(FILE* f);
+  void save(FILE* f) const;
   void load(FILE* f);
+  void save_compact(FILE* f) const;
+  void load_compact(FILE* f);
+  void save_delta(FILE* f) const;
+  void load_delta(FILE* f);
+  void persist(Arena& a) {
+    if (a.adopt(t, N+B*4, orig_address)) orig_address=0;
+  }
+  void reset_to(const HashTable& g, const HashTable* c=0) {  // see PredictorImpl::reset_to()
+    written.copy(t, g.t);
+    if (c) {
+      c->written.copy(t, c->t);
+      written=c->written;
+    }
+    else written.clear();
+    dirty=(c ? c : &g)->dirty;
+    evictions=(c ? c : &g)->evictions;
+  }
+  template <int M> void resize_from(const HashTable<B, M>& g) {
+    if (M<=N) {
+      for (int i=0; i<N; i+=M)
+        memmove(t+i, g.t, M);
+      return;
+    }
+    memmove(t, g.t, N);
+    for (int i=N; i<M; i+=B)
+      if (g.t[i+1]>t[(i&N-1)+1]) memmove(t+(i&N-1), g.t+i, B);
+  }
+  
+  void merge(const HashTable* const* hs, int n) {
+    memmove(t, hs[0]->t, N+B*4);
+    for (int k=1; k<n; ++k)
+      for (int i=0; i<N; i+=B)
+        if (hs[k]->t[i+1]>t[i+1]) memmove(t+i, hs[k]->t+i, B);
+  }
   
   U8* operator[](U32 i);
+  void prefetch(U32 i) const {
+    i*=123456791;
+    i=i<<16|i>>16;
+    i*=234567891;
+    __builtin_prefetch(t+(i*B&N-B));
+  }
 };
 
-template <int B>
-HashTable<B>::HashTable(int n): t(0), N(n) {
-  assert(B>=2 && (B&B-1)==0);
-  assert(N>=B*4 && (N&N-1)==0);
+template <int B, int N>
+HashTable<B,N>::HashTable(): t(0), dirty(N+B*4), written(N+B*4), evictions(0) {
+  static_assert(B>=2 && (B&B-1)==0, "B must be a power of 2");
+  static_assert(B*4<=64, "the candidates of an index must share one line");
+  static_assert(N>=B*4 && (N&N-1)==0, "N must be a power of 2");
   alloc(t, N+B*4+64);
   orig_address = t;
   t+=64-int(((long)t)&63);  // align on cache line boundary
 }
 
-template <int B>
-HashTable<B>::HashTable(const HashTable &c) : t(0), N(c.N) {
+template <int B, int N>
+HashTable<B,N>::HashTable(const HashTable &c) : t(0), dirty(c.dirty), written(c.written), evictions(c.evictions) {
   alloc(t, N+B*4+64);
   orig_address = t;
   t+=64-int(((long)t)&63);  // align on cache line boundary
@@ -412,43 +979,77 @@ HashTable<B>::HashTable(const HashTable &c) : t(0), N(c.N) {
   memmove(t, c.t, (N+B*4)*sizeof(*t));
 }
 
-template <int B>
-const HashTable<B>& HashTable<B>::operator= (const HashTable<B>& c) {
+template <int B, int N>
+const HashTable<B,N>& HashTable<B,N>::operator= (const HashTable<B,N>& c) {
   if (&c==this) return *this;
-  assert(N==c.N);
   memmove(t, c.t, (N+B*4)*sizeof(*t));
+  dirty=c.dirty;
+  written=c.written;
+  evictions=c.evictions;
   return *this;
 }
 
-template <int B>
-HashTable<B>::~HashTable() {
+template <int B, int N>
+HashTable<B,N>::~HashTable() {
   free(orig_address);
 }
 
-template <int B>
-void HashTable<B>::save(FILE* f) {
+template <int B, int N>
+void HashTable<B,N>::save(FILE* f) const {
   SIGNATURE(B)
-  SER(N) SERN(*t, N+B*4)
+  int n=N;
+  SER(n) SERN(*t, N+B*4)
 }
 
-template <int B>
-void HashTable<B>::load(FILE* f) {
+template <int B, int N>
+void HashTable<B,N>::load(FILE* f) {
   CHECKSIG(B)
   DSERC(N) DSERN(*t, N+B*4)
 }
 
-template <int B>
-inline U8* HashTable<B>::operator[](U32 i) {
+template <int B, int N>
+void HashTable<B,N>::save_compact(FILE* f) const {
+  SIGNATURE(B)
+  put_varint(f, N);
+  put_sparse(f, t, N+B*4);
+}
+
+template <int B, int N>
+void HashTable<B,N>::load_compact(FILE* f) {
+  CHECKSIG(B)
+  if (get_varint(f)!=N) quit("State file does not match the model");
+  get_sparse(f, t, N+B*4);
+}
+
+template <int B, int N>
+void HashTable<B,N>::save_delta(FILE* f) const {
+  SIGNATURE(B)
+  put_varint(f, N);
+  dirty.save(f, t);
+}
+
+template <int B, int N>
+void HashTable<B,N>::load_delta(FILE* f) {
+  CHECKSIG(B)
+  if (get_varint(f)!=N) quit("State file does not match the model");
+  dirty.load(f, t);
+}
+
+template <int B, int N>
+inline U8* HashTable<B,N>::operator[](U32 i) {
   i*=123456791;
   i=i<<16|i>>16;
   i*=234567891;
   int chk=i>>24;
   i=i*B&N-B;
+  dirty.mark(i);
+  written.mark(i);
   if (t[i]==chk) return t+i;
   if (t[i^B]==chk) return t+(i^B);
   if (t[i^B*2]==chk) return t+(i^B*2);
   if (t[i+1]>t[i+1^B] || t[i+1]>t[i+1^B*2]) i^=B;
   if (t[i+1]>t[i+1^B^B*2]) i^=B^B*2;
+  evictions+=t[i+1]!=0;
   memset(t+i, 0, B);
   t[i]=chk;
   return t+i;
@@ -456,15 +1057,28 @@ inline U8* HashTable<B>::operator[](U32 i) {
 
 //////////////////////////// MatchModel ////////////////////////
 
-// MatchModel(n) predicts next bit using most recent context match.
+// MatchModel<n> predicts next bit using most recent context match.
 //     using n bytes of memory.  n must be a power of 2 at least 8.
 // MatchModel::p(y, m) updates the model with bit y (0..1) and writes
 //     a prediction of the next bit to Mixer m.  It returns the length of
 //     context matched (0..62).
-
+// MatchModel::prefetch(c) starts loading the index entries that will
+//     be used if the current byte ends as c (256..511, with leading 1).
+// MatchModel::save_context(f) and load_context(f) are save_scalars() and
+//     load_scalars() without the position in buf: the context of one of
+//     several streams that append to the same history.
+// MatchModel::resize_from(m) takes over the state of m, of another size,
+//     on a byte boundary.  As much recent history as fits is moved to
+//     the start of buf, oldest first, and the index is rebuilt by hashing
+//     it again.
+// MatchModel::merge(ms, seen, n) does the same for the concatenated
+//     history of ms[0..n-1], which have seen seen[k] bytes each.  Their
+//     StateMaps are merged.
+
+template <int n>
 class MatchModel {
-  const int N;  // last buffer index, n/2-1
-  const int HN; // last hash table index, n/8-1
+  enum {N=n/2-1};  // last buffer index, n/2-1
+  enum {HN=n/8-1}; // last hash table index, n/8-1
   enum {MAXLEN=62};   // maximum match length, at most 62
   U8* buf;    // input buffer
   int* ht;    // context hash -> next byte in buf
@@ -475,37 +1089,68 @@ class MatchModel {
   int c0;     // last 0-7 bits of y
   int bcount; // number of bits in c0 (0..7)
   StateMap sm;  // len, bit, last byte -> prediction
+  DirtyMap bufdirty, htdirty;  // lines of buf and ht written since clean()
+  DirtyMap bufwritten, htwritten;  // and since track_writes() or reset_to()
 public:
-  MatchModel(int n);  // n must be a power of 2 at least 8.
+  MatchModel();
   MatchModel(const MatchModel &mm);
   const MatchModel& operator= (const MatchModel& mm);
   ~MatchModel();
-  void save(FILE* f);
+  void save(FILE* f) const;
   void load(FILE* f);
+  void save_compact(FILE* f) const;
+  void load_compact(FILE* f);
+  void save_delta(FILE* f) const;
+  void load_delta(FILE* f);
+  void track_changes() { bufdirty.start(); htdirty.start(); }
+  void clean() { bufdirty.clear(); htdirty.clear(); }
+  void track_writes(bool on=true) {
+    if (on) bufwritten.start(), htwritten.start();
+    else bufwritten.stop(), htwritten.stop();
+  }
+  void reset_to(const MatchModel& mm, const MatchModel* c=0);
+  void persist(Arena& a) { a.adopt(buf, N+1); a.adopt(ht, HN+1); sm.persist(a); }
+  void save_scalars(FILE* f) const;
+  void load_scalars(FILE* f);
+  void save_context(FILE* f) { save_scalars(f); }
+  void load_context(FILE* f) { int p=pos; load_scalars(f); pos=p; }
+  template <int m> void resize_from(const MatchModel<m>& mm);
+  void merge(const MatchModel* const* ms, const U32* seen, int count);
+  void reindex(int window);
+  template <int> friend class MatchModel;
   
   int p(int y, Mixer& m);  // update bit y (0..1), predict next bit to m
+  void prefetch(int c) const {
+    __builtin_prefetch(&ht[h1*(3<<3)+c&HN]);
+    __builtin_prefetch(&ht[h2*(5<<5)+c&HN]);
+  }
 };
 
-MatchModel::MatchModel(int n): N(n/2-1), HN(n/8-1), buf(0), ht(0), pos(0), 
-    match(0), len(0), h1(0), h2(0), c0(1), bcount(0), sm(56<<8) {
-  assert(n>=8 && (n&n-1)==0);
+template <int n>
+MatchModel<n>::MatchModel(): buf(0), ht(0), pos(0), 
+    match(0), len(0), h1(0), h2(0), c0(1), bcount(0), sm(56<<8),
+    bufdirty(N+1), htdirty((HN+1)*sizeof(int)),
+    bufwritten(N+1), htwritten((HN+1)*sizeof(int)) {
+  static_assert(n>=8 && (n&n-1)==0, "n must be a power of 2 at least 8");
   alloc(buf, N+1);
   alloc(ht, HN+1);
 }
 
-MatchModel::MatchModel(const MatchModel &mm): N(mm.N), HN(mm.HN), buf(0), ht(0), 
-  pos(mm.pos), match(mm.match), len(mm.len), h1(mm.h1), h2(mm.h2), c0(mm.c0), bcount(mm.bcount), sm(mm.sm) {
+template <int n>
+MatchModel<n>::MatchModel(const MatchModel &mm): buf(0), ht(0), 
+  pos(mm.pos), match(mm.match), len(mm.len), h1(mm.h1), h2(mm.h2), c0(mm.c0), bcount(mm.bcount), sm(mm.sm),
+  bufdirty(mm.bufdirty), htdirty(mm.htdirty),
+  bufwritten(mm.bufwritten), htwritten(mm.htwritten) {
   alloc(buf, N+1);
   alloc(ht, HN+1);
   memmove(buf, mm.buf, N+1);
   memmove(ht, mm.ht, (HN+1)*sizeof(*ht));
 }
-const MatchModel& MatchModel::operator= (const MatchModel& mm) {
+
+template <int n>
+const MatchModel<n>& MatchModel<n>::operator= (const MatchModel& mm) {
   if (&mm==this) return *this;
   
-  assert(N == mm.N);
-  assert(HN == mm.HN);
-  
   pos = mm.pos;
   match = mm.match;
   len = mm.len;
@@ -514,27 +1159,180 @@ const MatchModel& MatchModel::operator= (const MatchModel& mm) {
   c0=(mm.c0);
   bcount=(mm.bcount);
   sm=(mm.sm);
+  bufdirty=mm.bufdirty;
+  htdirty=mm.htdirty;
+  bufwritten=mm.bufwritten;
+  htwritten=mm.htwritten;
   
   memmove(buf, mm.buf, N+1);
   memmove(ht, mm.ht, (HN+1)*sizeof(*ht));
   
   return *this;
 }
-MatchModel::~MatchModel() {
-  free(buf);
-  free(ht);
+
+template <int n>
+MatchModel<n>::~MatchModel() {
+  dealloc(buf);
+  dealloc(ht);
 }
 
-void MatchModel::save(FILE* f) {
+template <int n>
+void MatchModel<n>::save(FILE* f) const {
   SIGNATURE(88334)
-  SER(N) SER(HN) SERN(*buf, N+1) SERN(*ht, HN+1) SER(pos) SER(match) SER(len) SER(h1) SER(h2) SER(c0) SER(bcount) sm.save(f);
+  int nn=N, hn=HN;
+  SER(nn) SER(hn) SERN(*buf, N+1) SERN(*ht, HN+1) SER(pos) SER(match) SER(len) SER(h1) SER(h2) SER(c0) SER(bcount) sm.save(f);
 }
-void MatchModel::load(FILE* f) {
+
+template <int n>
+void MatchModel<n>::load(FILE* f) {
   CHECKSIG(88334)
   DSERC(N) DSERC(HN) DSERN(*buf, N+1) DSERN(*ht, HN+1) DSER(pos) DSER(match) DSER(len) DSER(h1) DSER(h2) DSER(c0) DSER(bcount) sm.load(f);
 }
-  
-int MatchModel::p(int y, Mixer& m) {
+
+template <int n>
+void MatchModel<n>::save_compact(FILE* f) const {
+  SIGNATURE(88334)
+  put_varint(f, N);
+  put_varint(f, HN);
+  put_sparse(f, buf, N+1);
+  put_u32s(f, (const U32*)ht, HN+1, zero_initial);
+  SER(pos) SER(match) SER(len) SER(h1) SER(h2) SER(c0) SER(bcount)
+  sm.save_compact(f, statemap_initial);
+}
+
+template <int n>
+void MatchModel<n>::load_compact(FILE* f) {
+  CHECKSIG(88334)
+  if (get_varint(f)!=N || get_varint(f)!=HN)
+    quit("State file does not match the model");
+  get_sparse(f, buf, N+1);
+  get_u32s(f, (U32*)ht, HN+1, zero_initial);
+  DSER(pos) DSER(match) DSER(len) DSER(h1) DSER(h2) DSER(c0) DSER(bcount)
+  sm.load_compact(f, statemap_initial);
+}
+
+// Like save_compact(), but buf and ht only as the lines written since
+// clean()
+template <int n>
+void MatchModel<n>::save_delta(FILE* f) const {
+  SIGNATURE(88334)
+  put_varint(f, N);
+  put_varint(f, HN);
+  bufdirty.save(f, buf);
+  htdirty.save(f, (const U8*)ht);
+  SER(pos) SER(match) SER(len) SER(h1) SER(h2) SER(c0) SER(bcount)
+  sm.save_compact(f, statemap_initial);
+}
+
+template <int n>
+void MatchModel<n>::load_delta(FILE* f) {
+  CHECKSIG(88334)
+  if (get_varint(f)!=N || get_varint(f)!=HN)
+    quit("State file does not match the model");
+  bufdirty.load(f, buf);
+  htdirty.load(f, (U8*)ht);
+  DSER(pos) DSER(match) DSER(len) DSER(h1) DSER(h2) DSER(c0) DSER(bcount)
+  sm.load_compact(f, statemap_initial);
+}
+
+// Like operator=, for a copy of mm: only the lines of buf and ht written
+// since track_writes() or the last reset_to() are copied back.  With c,
+// another such copy of mm, the lines c wrote are then copied from c.
+template <int n>
+void MatchModel<n>::reset_to(const MatchModel& m, const MatchModel* c) {
+  bufwritten.copy(buf, m.buf);
+  htwritten.copy((U8*)ht, (const U8*)m.ht);
+  if (c) {
+    c->bufwritten.copy(buf, c->buf);
+    c->htwritten.copy((U8*)ht, (const U8*)c->ht);
+    bufwritten=c->bufwritten;
+    htwritten=c->htwritten;
+  }
+  else {
+    bufwritten.clear();
+    htwritten.clear();
+  }
+  const MatchModel& mm=c ? *c : m;
+  bufdirty=mm.bufdirty;
+  htdirty=mm.htdirty;
+  pos=mm.pos;
+  match=mm.match;
+  len=mm.len;
+  h1=mm.h1;
+  h2=mm.h2;
+  c0=mm.c0;
+  bcount=mm.bcount;
+  sm=mm.sm;
+}
+
+template <int n>
+void MatchModel<n>::save_scalars(FILE* f) const {
+  SER(pos) SER(match) SER(len) SER(h1) SER(h2) SER(c0) SER(bcount)
+  sm.save_scalars(f);
+}
+
+template <int n>
+void MatchModel<n>::load_scalars(FILE* f) {
+  DSER(pos) DSER(match) DSER(len) DSER(h1) DSER(h2) DSER(c0) DSER(bcount)
+  sm.load_scalars(f);
+}
+
+template <int n>
+template <int m>
+void MatchModel<n>::resize_from(const MatchModel<m>& mm) {
+  assert(mm.bcount==0);
+  const int window=int(mm.N)<int(N) ? mm.N+1 : N+1;  // bytes kept
+  const int start=mm.pos-window;           // in mm.buf, masked
+  for (int i=0; i<window; ++i)
+    buf[i]=mm.buf[start+i&mm.N];
+  match=mm.match-start&mm.N;
+  len=mm.len;
+  if (match>=window) match=len=0;
+  c0=mm.c0;
+  bcount=mm.bcount;
+  sm=mm.sm;
+  reindex(window);
+}
+
+template <int n>
+void MatchModel<n>::merge(const MatchModel* const* ms, const U32* seen, int count) {
+  int at=N+1;  // buf is filled from the end, the last history last
+  for (int k=count-1; k>=0 && at>0; --k) {
+    assert(ms[k]->bcount==0);
+    const int l=seen[k]<U32(at) ? int(seen[k]) : at;
+    at-=l;
+    for (int i=0; i<l; ++i)
+      buf[at+i]=ms[k]->buf[ms[k]->pos-l+i&N];
+  }
+  const int window=N+1-at;
+  memmove(buf, buf+at, window);
+  memset(buf+window, 0, at);
+  match=len=0;
+  c0=1;
+  bcount=0;
+  const StateMap** sms=new const StateMap*[count];
+  for (int k=0; k<count; ++k)
+    sms[k]=&ms[k]->sm;
+  sm.merge(sms, count);
+  delete[] sms;
+  reindex(window);
+}
+
+// Hash buf[0..window) into an empty ht, as if it had just been seen
+template <int n>
+void MatchModel<n>::reindex(int window) {
+  pos=window&N;
+  h1=h2=0;
+  for (int i=0; i<window; ++i) {
+    h1=h1*(3<<3)+buf[i]+256&HN;
+    h2=h2*(5<<5)+buf[i]+256&HN;
+    ht[h1]=i+1&N;
+    ht[h2]=i+1&N;
+  }
+}
+
+template <int n>
+int MatchModel<n>::p(int y, Mixer& m) {
 
   // update context
   c0+=c0+y;
@@ -543,6 +1341,8 @@ int MatchModel::p(int y, Mixer& m) {
     bcount=0;
     h1=h1*(3<<3)+c0&HN;
     h2=h2*(5<<5)+c0&HN;
+    bufdirty.mark(pos);
+    bufwritten.mark(pos);
     buf[pos++]=c0;
     c0=1;
     pos&=N;
@@ -590,6 +1390,10 @@ int MatchModel::p(int y, Mixer& m) {
   if (bcount==0) {
     ht[h1]=pos;
     ht[h2]=pos;
+    htdirty.mark(h1*sizeof(int));
+    htdirty.mark(h2*sizeof(int));
+    htwritten.mark(h1*sizeof(int));
+    htwritten.mark(h2*sizeof(int));
   }
   return len;
 }
@@ -598,58 +1402,256 @@ int MatchModel::p(int y, Mixer& m) {
 
 // A Predictor estimates the probability that the next bit of
 // uncompressed data is 1.  Methods:
-// Predictor(n) creates with 3*n bytes of memory.
+// new_predictor(n) creates one with 3*n bytes of memory.
 // p() returns P(1) as a 12 bit number (0-4095).
 // update(y) trains the predictor with the actual bit (0 or 1).
+//
+// Predictor is an interface; the model itself is PredictorImpl<MEM>,
+// instantiated once per memory option so that all table sizes and
+// masks are compile time constants.  new_predictor() picks the
+// instantiation once, and BitPredictor only calls through the vtable.
+//
+// set_level(l) trades compression for speed by switching off some of
+// the models (see levels[] below).  It may only be called on a byte
+// boundary, and the decompressor must switch at the same point.
+//
+// prefetch(y) changes nothing; it issues prefetches for the hash table
+// lines that update(y) is going to look up, so that a caller driving
+// several predictors can overlap their cache misses.
+//
+// Every saved state gets a random 64-bit id, stored after the end
+// signature (files without one load with id 0).  After track_changes(),
+// save_delta() writes the hash table and match model lines written since
+// the last load or delta, plus all of the small tables, as a patch from
+// base_id to id; load_delta() applies it to a predictor in state base_id.
+// Saving a whole state doesn't change the predictor, except to give it
+// its id.
+
+// A PersistFile is a state file mapped into memory, holding a header
+// and the tables of one predictor (see PredictorImpl::persist).  The
+// scalars are kept in two slots of the header, a new copy is written
+// to the other slot before switching, so that one is always complete.
+// in_use is set while a process has the file open; if it is still set
+// on opening, that process died and its tables may be ahead of the
+// scalars.
+
+struct PersistHeader {
+  enum {SIZE=4096, SLOT=2000};
+  int signature;      // 991224 once the file is complete
+  int mem;
+  long long size;     // bytes of tables after the header
+  int in_use;
+  int slot;           // scalar slot in use, 0 or 1
+  char scalars[2][SLOT];
+};
+
+class PersistFile {
+  int fd;
+  size_t length;
+  Mapped range;
+public:
+  U8* base;
+  PersistHeader* header;
+  bool fresh;  // created now, no state in it yet
+  PersistFile(const char* path, int mem, size_t size);
+  ~PersistFile();
+  U8* tables() const { return base+PersistHeader::SIZE; }
+};
+
+PersistFile::PersistFile(const char* path, int mem, size_t size):
+    length(PersistHeader::SIZE+size) {
+  static_assert(sizeof(PersistHeader)<=PersistHeader::SIZE, "header too big");
+  fd=open(path, O_RDWR|O_CREAT, 0644);
+  if (fd<0) quit("Can't open persistent state file");
+  if (flock(fd, LOCK_EX|LOCK_NB)) quit("Persistent state file is in use");
+  struct stat st;
+  fstat(fd, &st);
+  fresh=st.st_size==0;
+  if (fresh && ftruncate(fd, length)) quit("Can't size persistent state file");
+  if (!fresh && st.st_size!=length)
+    quit("Persistent state file has a different memory size");
+  base=(U8*)mmap(0, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base==MAP_FAILED) quit("Can't map persistent state file");
+  header=(PersistHeader*)base;
+  if (!fresh && (header->signature!=991224 || header->mem!=mem
+      || header->size!=size))
+    quit("Not a persistent state file for this memory size");
+  range.lo=base;
+  range.hi=base+length;
+  range.next=mapped;
+  mapped=&range;
+}
+
+PersistFile::~PersistFile() {
+  header->in_use=0;
+  msync(base, length, MS_ASYNC);
+  for (Mapped** m=&mapped; *m; m=&(*m)->next)
+    if (*m==&range) {
+      *m=range.next;
+      break;
+    }
+  munmap(base, length);
+  close(fd);
+}
+
+static U64 new_state_id() {
+  static U64 n=0;
+  U64 x=U64(time(0))<<32^U64(getpid())<<12^U64(clock())^++n*0x9E3779B97F4A7C15ull;
+  x^=x>>31;
+  x*=0xbf58476d1ce4e5b9ull;
+  x^=x>>29;
+  return x ? x : 1;
+}
 
 struct Predictor {
   int pr;  // next prediction
+  mutable U64 id;  // id of the saved or loaded state, 0 after any update
+  U64 base_id;  // id of the state save_delta() is against, dirty lines since
+  PersistFile* persist_file;  // where the tables live, or NULL (heap)
+public:
+  Predictor(): pr(2048), id(0), base_id(0), persist_file(0) {}
+  virtual ~Predictor() { delete persist_file; }  // after the tables
+  virtual Predictor* clone() const = 0;
+  virtual void assign(const Predictor& p) = 0;  // p must have the same MEM
+  virtual void reset_to(const Predictor& p, const Predictor* c) = 0;  // likewise
+  virtual int mem() const = 0;
+  virtual void save(FILE* f) const = 0;
+  virtual void load(FILE* f, bool checkmem) = 0;
+  virtual void save_compact(FILE* f) const = 0;
+  virtual void load_compact(FILE* f) = 0;  // after the header
+  virtual void track_changes() = 0;
+  virtual void save_delta(FILE* f) = 0;
+  virtual void load_delta(FILE* f) = 0;  // after the header
+  virtual void persist(const char* path) = 0;
+  virtual void sync() = 0;
+  virtual bool full() const = 0;
+  virtual Predictor* grow() const = 0;  // NULL at the largest size
+  virtual Predictor* shrink() const = 0;  // NULL at the smallest size
+  virtual void merge(const Predictor* const* ps, int n) = 0;  // same MEM
+  virtual void update(int y) = 0;
+  virtual void update_bytes(const U8* buf, int n) = 0;
+  virtual void encode(BitCoder& c, const U8* buf, int n) = 0;
+  virtual void decode(BitCoder& c, U8* buf, int n) = 0;
+  virtual long long cost(const U8* buf, int n, long long bound) = 0;
+  virtual void cost_many(Predictor* const* ps, int k, const U8* buf, int n, long long* s) = 0;  // all of them this MEM
+  virtual void prefetch(int y) const = 0;
+  virtual void set_level(int l) = 0;
+  virtual int get_level() const = 0;
+  virtual void save_context(FILE* f) = 0;
+  virtual void load_context(FILE* f) = 0;
   
-  int MEM;
-  U8 t0[0x10000];  // order 1 cxt -> state
-  HashTable<16>t;  // cxt -> state
+  int p() const {assert(pr>=0 && pr<4096); return pr;}
+};
+
+// Model levels.  orders is a mask of the context models sm[0..5]
+// (orders 1, 2, 3, 4, 6 and word) feeding the mixer, apms is the number
+// of APM stages after it.  The match model is always used, and order 1
+// is always on.  Disabled models are neither looked up nor updated, and
+// input 0 to the mixer, which keeps every model on its own weights (a 0
+// input neither counts nor trains): a level change mustn't hand the
+// weights of one order to another.
+static const struct {
+  int orders;
+  int apms;
+} levels[]={
+  {0x3f, 2},  // 0: lpaq1: orders 1-4, 6, word, match; 2 APMs
+  {0x1f, 1},  // 1: orders 1-4, 6, match; 1 APM
+  {0x0b, 0},  // 2: orders 1, 2, 4, match; no APM
+  {0x03, 0},  // 3: orders 1, 2, match; no APM
+};
+enum {NLEVELS=sizeof(levels)/sizeof(*levels)};
+
+template <int MEM /*Global memory usage = 3*MEM bytes (1<<20 .. 1<<29) */>
+struct PredictorImpl final : public Predictor {
+  enum {T0SIZE=0x10000};
+  U8* t0;  // order 1 cxt -> state, T0SIZE
+  HashTable<16, MEM*2> t;  // cxt -> state
   int c0;  // last 0-7 bits with leading 1
   int c4;  // last 4 bytes
   U8 *cp[6];  // pointer to bit history
   int bcount;  // bit count
-  StateMap sm[6];
+  StateMapSet<6> sm;  // bit history -> prediction for each context
   APM a1;
   APM a2;
   U32 h[6];
   Mixer m;
-  MatchModel mm;  // predicts next bit by matching context
+  MatchModel<MEM> mm;  // predicts next bit by matching context
+  int level;  // index into levels[]
+  U32 bytes;  // bytes seen since construction or grow
 public:
-  Predictor(int MEM);
-  Predictor(const Predictor& p);
-  void rebase_pointers(const Predictor& p);
-  const Predictor& operator= (const Predictor& p);
-  ~Predictor();
-  void save(FILE* f);
-  void load(FILE* f, bool checkmem);
+  PredictorImpl();
+  PredictorImpl(const PredictorImpl& p);
+  void rebase_pointers(const PredictorImpl& p);
+  const PredictorImpl& operator= (const PredictorImpl& p);
   
-  int p() const {assert(pr>=0 && pr<4096); return pr;}
+  Predictor* clone() const { return new PredictorImpl(*this); }
+  void assign(const Predictor& p) {
+    if (p.mem() != MEM) quit("Predictors have different memory sizes");
+    *this = static_cast<const PredictorImpl&>(p);
+  }
+  void reset_to(const Predictor& p, const Predictor* c);
+  int mem() const { return MEM; }
+  void save(FILE* f) const;
+  void load(FILE* f, bool checkmem);
+  void save_compact(FILE* f) const;
+  void load_compact(FILE* f);
+  void track_changes();
+  void save_delta(FILE* f);
+  void load_delta(FILE* f);
+  void save_body(FILE* f, bool delta) const;
+  void load_body(FILE* f, bool delta);
+  void clean();
+  void mark_cp();
+  void track_writes(bool on);
+  void persist(const char* path);
+  void persist_tables(Arena& a);
+  void sync();
+  void save_scalars(FILE* f) const;
+  void load_scalars(FILE* f);
+  ~PredictorImpl();
+  bool full() const;
+  Predictor* grow() const;
+  Predictor* shrink() const;
+  template <int M> void resize_from(const PredictorImpl<M>& p);
+  void merge(const Predictor* const* ps, int n);
   void update(int y);
+  void update_bytes(const U8* buf, int n);
+  void encode(BitCoder& c, const U8* buf, int n);
+  void decode(BitCoder& c, U8* buf, int n);
+  long long cost(const U8* buf, int n, long long bound);
+  void cost_many(Predictor* const* ps, int k, const U8* buf, int n, long long* s);
+  void prefetch(int y) const;
+  void set_level(int l);
+  int get_level() const { return level; }
+  void save_context(FILE* f);
+  void load_context(FILE* f);
 };
 
-Predictor::Predictor(int MEM /*Global memory usage = 3*MEM bytes (1<<20 .. 1<<29) */) :
-    MEM(MEM),
-    t(MEM*2),
+template <int MEM>
+PredictorImpl<MEM>::PredictorImpl() :
     c0(1),
     c4(0),
-    cp{t0, t0, t0, t0, t0, t0},
     bcount(0),
     a1(0x100), 
     a2(0x4000),
     m(7, 80),
-    mm(MEM),
-    pr(2048) {
-        memset(t0, 0, sizeof(t0));
+    level(0),
+    bytes(0) {
+        alloc(t0, T0SIZE);
+        for (int i = 0; i < sizeof(cp)/sizeof(*cp); ++i) cp[i] = t0;
         memset(h, 0, sizeof(h));
 }
 
-void Predictor::rebase_pointers(const Predictor& p) {
+template <int MEM>
+PredictorImpl<MEM>::~PredictorImpl() {
+  if (persist_file) sync();
+  dealloc(t0);
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::rebase_pointers(const PredictorImpl& p) {
   for (int i = 0; i < sizeof(cp)/sizeof(*cp); ++i) {
-    if (p.cp[i] >= p.t0 && p.cp[i] < p.t0 + sizeof(t0)) {
+    if (p.cp[i] >= p.t0 && p.cp[i] < p.t0 + T0SIZE) {
         cp[i] = t0 + (p.cp[i] - p.t0);
     } else 
     if (p.cp[i] >= p.t.t && p.cp[i] < p.t.t + (MEM*2+16*4)) {
@@ -660,8 +1662,8 @@ void Predictor::rebase_pointers(const Predictor& p) {
   }
 }
 
-Predictor::Predictor(const Predictor& p) :
-    MEM(p.MEM),
+template <int MEM>
+PredictorImpl<MEM>::PredictorImpl(const PredictorImpl& p) :
     t(p.t),
     c0(p.c0),
     c4(p.c4),
@@ -671,48 +1673,50 @@ Predictor::Predictor(const Predictor& p) :
     a2(p.a2),
     m(p.m),
     mm(p.mm),
-    pr(p.pr) {
-      memmove(t0, p.t0, sizeof(t0));
+    level(p.level),
+    bytes(p.bytes) {
+      pr = p.pr;
+      id = p.id;
+      base_id = p.base_id;
+      alloc(t0, T0SIZE);
+      memmove(t0, p.t0, T0SIZE);
       rebase_pointers(p);
       memmove(h, p.h, sizeof(h));
 }
 
-const Predictor& Predictor::operator= (const Predictor& p) {
+template <int MEM>
+const PredictorImpl<MEM>& PredictorImpl<MEM>::operator= (const PredictorImpl& p) {
   if (&p==this) return *this;
   
-  assert(p.MEM == MEM);
-  
   t = p.t;
   c0 = p.c0;
   c4 = p.c4;
   bcount = p.bcount;
-  for (int i = 0; i < sizeof(sm)/sizeof(*sm); ++i) {
-    sm[i] = p.sm[i];
-  }
+  sm = p.sm;
   a1 = p.a1;
   a2 = p.a2;
   m = p.m;
   mm = p.mm;
+  level = p.level;
+  bytes = p.bytes;
   pr = p.pr;
+  id = p.id;
+  base_id = p.base_id;
   
-  memmove(t0, p.t0, sizeof(t0));
+  memmove(t0, p.t0, T0SIZE);
   rebase_pointers(p);
   memmove(h, p.h, sizeof(h));
   
   return *this;
 }
 
-Predictor::~Predictor() {
-  
-}
-
-void Predictor::save(FILE* f) {
+template <int MEM>
+void PredictorImpl<MEM>::save(FILE* f) const {
   SIGNATURE(991221)
-  SER(MEM) SER(t0) SER(c0) SER(c4) SER(bcount)
+  int mem=MEM;
+  SER(mem) SERN(*t0, T0SIZE) SER(c0) SER(c4) SER(bcount)
   t.save(f);
-  for (int i = 0; i < sizeof(sm)/sizeof(*sm); ++i) {
-    sm[i].save(f);
-  }
+  sm.save(f);
   SIGNATURE(1886)
   a1.save(f);
   a2.save(f);
@@ -724,7 +1728,7 @@ void Predictor::save(FILE* f) {
   for (int i = 0; i < sizeof(cp)/sizeof(*cp); ++i) {
     int type;
     int offset;
-    if (cp[i] >= t0 && cp[i] < t0 + sizeof(t0)) {
+    if (cp[i] >= t0 && cp[i] < t0 + T0SIZE) {
       type = 34;
       offset = (cp[i] - t0);
     } else 
@@ -737,17 +1741,19 @@ void Predictor::save(FILE* f) {
     SER(type) SER(offset)
   }
   SIGNATURE(0x9999)
+  if (!id) id=new_state_id();
+  SER(id)
 }
-void Predictor::load(FILE* f, bool checkmem) {
+
+template <int MEM>
+void PredictorImpl<MEM>::load(FILE* f, bool checkmem) {
   if (checkmem) {
     CHECKSIG(991221)
     DSERC(MEM)
   }
-  DSER(t0) DSER(c0) DSER(c4) DSER(bcount)
+  DSERN(*t0, T0SIZE) DSER(c0) DSER(c4) DSER(bcount)
   t.load(f);
-  for (int i = 0; i < sizeof(sm)/sizeof(*sm); ++i) {
-    sm[i].load(f);
-  }
+  sm.load(f);
   CHECKSIG(1886)
   a1.load(f);
   a2.load(f);
@@ -771,19 +1777,529 @@ void Predictor::load(FILE* f, bool checkmem) {
     }
   }
   CHECKSIG(0x9999)
+  if (fread(&id, sizeof(id), 1, f)!=1) id=0;
+  clean();
+  track_writes(false);
+}
+
+// Compact state file: same content as save(), in the same order, but
+// coded as described above put_varint().  The header (signature 991222
+// and MEM) is raw so that BitPredictor can tell the formats apart.
+// A delta (991223) is the same with base_id and id in the header and
+// only the dirty lines of t and the match model.
+template <int MEM>
+void PredictorImpl<MEM>::save_compact(FILE* f) const {
+  SIGNATURE(991222)
+  int mem=MEM;
+  SER(mem)
+  save_body(f, false);
+  if (!id) id=new_state_id();
+  SER(id)
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::load_compact(FILE* f) {
+  load_body(f, false);
+  if (fread(&id, sizeof(id), 1, f)!=1) id=0;
+  clean();
+  track_writes(false);
+}
+
+// Record what changes from now on, against the current state if it was
+// just loaded and else against the next one loaded
+template <int MEM>
+void PredictorImpl<MEM>::track_changes() {
+  t.dirty.start();
+  mm.track_changes();
+  clean();
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::save_delta(FILE* f) {
+  if (!t.dirty.on()) quit("Changes aren't tracked for a delta");
+  if (!base_id) quit("No loaded state to write a delta against");
+  if (!id) id=new_state_id();
+  SIGNATURE(991223)
+  int mem=MEM;
+  SER(mem) SER(base_id) SER(id)
+  save_body(f, true);
+  clean();
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::load_delta(FILE* f) {
+  U64 from, to;
+  DSER(from) DSER(to)
+  if (!id || from!=id) quit("Delta does not apply to this state");
+  load_body(f, true);
+  id=to;
+  clean();
+  track_writes(false);
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::save_body(FILE* f, bool delta) const {
+  put_sparse(f, t0, T0SIZE);
+  put_varint(f, c0);
+  SER(c4)
+  put_varint(f, bcount);
+  if (delta) t.save_delta(f);
+  else t.save_compact(f);
+  sm.save_compact(f);
+  SIGNATURE(1886)
+  a1.save_compact(f);
+  a2.save_compact(f);
+  SER(h)
+  SIGNATURE(8338)
+  m.save_compact(f);
+  if (delta) mm.save_delta(f);
+  else mm.save_compact(f);
+  SIGNATURE(1221)
+  for (int i = 0; i < sizeof(cp)/sizeof(*cp); ++i) {
+    if (cp[i] >= t0 && cp[i] < t0 + T0SIZE) {
+      put_varint(f, 34);
+      put_varint(f, cp[i] - t0);
+    } else
+    if (cp[i] >= t.t && cp[i] < t.t + (MEM*2+16*4)) {
+      put_varint(f, 12);
+      put_varint(f, cp[i] - t.t);
+    } else {
+      assert(!"Invalid pointer");
+    }
+  }
+  SIGNATURE(0x9999)
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::load_body(FILE* f, bool delta) {
+  get_sparse(f, t0, T0SIZE);
+  c0=get_varint(f);
+  DSER(c4)
+  bcount=get_varint(f);
+  if (delta) t.load_delta(f);
+  else t.load_compact(f);
+  sm.load_compact(f);
+  CHECKSIG(1886)
+  a1.load_compact(f);
+  a2.load_compact(f);
+  DSER(h)
+  CHECKSIG(8338)
+  m.load_compact(f);
+  if (delta) mm.load_delta(f);
+  else mm.load_compact(f);
+  CHECKSIG(1221)
+  for (int i = 0; i < sizeof(cp)/sizeof(*cp); ++i) {
+    int type=get_varint(f);
+    int offset=get_varint(f);
+    if (type == 34 && offset < T0SIZE) {
+      cp[i] = t0 + offset;
+    } else
+    if (type == 12 && offset < MEM*2+16*4) {
+      cp[i] = t.t + offset;
+    } else {
+      quit("Corrupt state file");
+    }
+  }
+  CHECKSIG(0x9999)
+}
+
+// Move the tables into a memory mapped file, so that what the model
+// learns goes to the file through the page cache.  A new file gets the
+// current state; an existing one replaces it, without reading it.  The
+// scalars are kept in the file header by sync().
+template <int MEM>
+void PredictorImpl<MEM>::persist(const char* path) {
+  if (persist_file) quit("Predictor is already persistent");
+  Arena measure(0, 0, false);
+  persist_tables(measure);
+  PersistFile* pf=new PersistFile(path, MEM, measure.used());
+  Arena a(pf->tables(), measure.used(), pf->fresh);
+  persist_tables(a);
+  persist_file=pf;
+  PersistHeader* h=pf->header;
+  if (pf->fresh) {
+    sync();
+    h->mem=MEM;
+    h->size=measure.used();
+    h->signature=991224;
+  } else {
+    if (h->in_use)
+      fprintf(stderr, "Warning: persistent state was not closed cleanly\n");
+    FILE* f=fmemopen(h->scalars[h->slot], PersistHeader::SLOT, "rb");
+    if (!f) quit("fmemopen failed");
+    load_scalars(f);
+    fclose(f);
+    track_writes(false);
+  }
+  h->in_use=1;
+}
+
+// Tables in the order of the persistent file; cp[] follows t0 and t
+template <int MEM>
+void PredictorImpl<MEM>::persist_tables(Arena& a) {
+  int type[6], offset[6];
+  for (int i = 0; i < sizeof(cp)/sizeof(*cp); ++i) {
+    type[i] = cp[i] >= t0 && cp[i] < t0 + T0SIZE;
+    offset[i] = type[i] ? cp[i] - t0 : cp[i] - t.t;
+  }
+  a.adopt(t0, T0SIZE);
+  t.persist(a);
+  sm.persist(a);
+  a1.persist(a);
+  a2.persist(a);
+  m.persist(a);
+  mm.persist(a);
+  for (int i = 0; i < sizeof(cp)/sizeof(*cp); ++i)
+    cp[i] = (type[i] ? t0 : t.t) + offset[i];
+}
+
+// Record the scalars in the persistent file, if any.  Like save(), not
+// pr or level, so reopening gives the same predictor as LOAD would.
+template <int MEM>
+void PredictorImpl<MEM>::sync() {
+  if (!persist_file) return;
+  PersistHeader* h=persist_file->header;
+  int slot=h->slot^1;
+  FILE* f=fmemopen(h->scalars[slot], PersistHeader::SLOT, "wb");
+  if (!f) quit("fmemopen failed");
+  save_scalars(f);
+  if (ftell(f)>=PersistHeader::SLOT) quit("Persistent header too small");
+  fclose(f);
+  __sync_synchronize();
+  h->slot=slot;
+  msync(persist_file->base, PersistHeader::SIZE+h->size, MS_ASYNC);
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::save_scalars(FILE* f) const {
+  SER(c0) SER(c4) SER(bcount) SER(h) SER(id) SER(base_id)
+  for (int i = 0; i < sizeof(cp)/sizeof(*cp); ++i) {
+    int type = cp[i] >= t0 && cp[i] < t0 + T0SIZE ? 34 : 12;
+    int offset = type == 34 ? cp[i] - t0 : cp[i] - t.t;
+    SER(type) SER(offset)
+  }
+  sm.save_scalars(f);
+  a1.save_scalars(f);
+  a2.save_scalars(f);
+  m.save_scalars(f);
+  mm.save_scalars(f);
+  SIGNATURE(0x9999)
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::load_scalars(FILE* f) {
+  DSER(c0) DSER(c4) DSER(bcount) DSER(h) DSER(id) DSER(base_id)
+  for (int i = 0; i < sizeof(cp)/sizeof(*cp); ++i) {
+    int type, offset;
+    DSER(type) DSER(offset)
+    cp[i] = (type == 34 ? t0 : t.t) + offset;
+  }
+  sm.load_scalars(f);
+  a1.load_scalars(f);
+  a2.load_scalars(f);
+  m.load_scalars(f);
+  mm.load_scalars(f);
+  CHECKSIG(0x9999)
+  clean();
+}
+
+// Online growth.  full() says the model has outgrown its memory: the
+// match model history has wrapped around, or the hash table has
+// replaced a quarter as many elements as it holds.  grow() returns a
+// copy of double the size (on a byte boundary); the hash table keeps
+// every element in both halves and the match model is reindexed.
+// shrink() returns a copy of half the size, keeping the higher priority
+// hash table elements and the more recent half of the match history.
+template <int MEM>
+bool PredictorImpl<MEM>::full() const {
+  return bytes>MEM/2 || t.evictions>MEM*2/16/4;
+}
+
+template <int MEM>
+struct Grow {
+  static Predictor* from(const PredictorImpl<MEM>& p) {
+    PredictorImpl<MEM*2>* q=new PredictorImpl<MEM*2>();
+    q->resize_from(p);
+    return q;
+  }
+};
+
+template <>
+struct Grow<1<<29> {
+  static Predictor* from(const PredictorImpl<1<<29>& p) { return NULL; }
+};
+
+template <int MEM>
+struct Shrink {
+  static Predictor* from(const PredictorImpl<MEM>& p) {
+    PredictorImpl<MEM/2>* q=new PredictorImpl<MEM/2>();
+    q->resize_from(p);
+    return q;
+  }
+};
+
+template <>
+struct Shrink<1<<20> {
+  static Predictor* from(const PredictorImpl<1<<20>& p) { return NULL; }
+};
+
+template <int MEM>
+Predictor* PredictorImpl<MEM>::grow() const {
+  assert(bcount==0);
+  if (t.dirty.on()) quit("A predictor tracking changes for a delta can't grow");
+  return Grow<MEM>::from(*this);
+}
+
+template <int MEM>
+Predictor* PredictorImpl<MEM>::shrink() const {
+  assert(bcount==0);
+  if (t.dirty.on()) quit("A predictor tracking changes for a delta can't shrink");
+  return Shrink<MEM>::from(*this);
+}
+
+template <int MEM>
+template <int M>
+void PredictorImpl<MEM>::resize_from(const PredictorImpl<M>& p) {
+  memmove(t0, p.t0, T0SIZE);
+  t.resize_from(p.t);
+  c0 = p.c0;
+  c4 = p.c4;
+  bcount = p.bcount;
+  sm = p.sm;
+  a1 = p.a1;
+  a2 = p.a2;
+  memmove(h, p.h, sizeof(h));
+  m = p.m;
+  mm.resize_from(p.mm);
+  level = p.level;
+  pr = p.pr;
+  for (int i = 0; i < sizeof(cp)/sizeof(*cp); ++i) {
+    if (p.cp[i] >= p.t0 && p.cp[i] < p.t0 + T0SIZE) cp[i] = t0 + (p.cp[i] - p.t0);
+    else cp[i] = t.t + (p.cp[i] - p.t.t & MEM*2-1);
+  }
+}
+
+// The same member of each of n predictors, as an array to merge
+template <class T, class M, class P>
+static const T** members(const P* const* p, int n, M P::*member) {
+  const T** r=new const T*[n];
+  for (int k=0; k<n; ++k)
+    r[k]=&(p[k]->*member);
+  return r;
+}
+
+#define MERGE(T, x) { const T** q=members<T>(p, n, &PredictorImpl::x); x.merge(q, n); delete[] q; }
+
+// Merge models trained on consecutive parts of the input, on byte
+// boundaries, into this new one.  Order 1 contexts take the byte tree of
+// t0 from the model with the highest priority (state of the first bit),
+// like hash table slots do.  StateMaps, APMs and mixer weights are
+// averaged, the context and match history continue from the last model.
+template <int MEM>
+void PredictorImpl<MEM>::merge(const Predictor* const* ps, int n) {
+  const PredictorImpl** p=new const PredictorImpl*[n];
+  U32* seen=new U32[n];
+  bytes=0;
+  for (int k=0; k<n; ++k) {
+    assert(ps[k]->mem()==MEM);
+    p[k]=static_cast<const PredictorImpl*>(ps[k]);
+    assert(p[k]->bcount==0);
+    seen[k]=p[k]->bytes;
+    bytes+=seen[k];
+  }
+  for (int c=0; c<T0SIZE; c+=256) {
+    int best=0;
+    for (int k=1; k<n; ++k)
+      if (p[k]->t0[c+1]>p[best]->t0[c+1]) best=k;
+    memmove(t0+c, p[best]->t0+c, 256);
+  }
+  typedef HashTable<16, MEM*2> Table;
+  MERGE(Table, t)
+  MERGE(StateMapSet<6>, sm)
+  MERGE(StateMap, a1)
+  MERGE(StateMap, a2)
+  MERGE(Mixer, m)
+  const MatchModel<MEM>** mms=members<MatchModel<MEM> >(p, n, &PredictorImpl::mm);
+  mm.merge(mms, seen, n);
+  delete[] mms;
+
+  const PredictorImpl& last=*p[n-1];
+  c0=last.c0;
+  c4=last.c4;
+  bcount=last.bcount;
+  memmove(h, last.h, sizeof(h));
+  level=last.level;
+  pr=last.pr;
+  for (int i = 0; i < sizeof(cp)/sizeof(*cp); ++i) {
+    if (last.cp[i] >= last.t0 && last.cp[i] < last.t0 + T0SIZE) cp[i] = t0 + (last.cp[i] - last.t0);
+    else cp[i] = t.t + (last.cp[i] - last.t.t);
+  }
+  id=0;
+  track_writes(false);
+  delete[] seen;
+  delete[] p;
+}
+
+#undef MERGE
+
+// Become p again, where this is a copy of p updated since (or since the
+// last reset_to(p)).  The hash table, APMs and match model copy back only
+// their lines written since then, the small tables are copied whole.
+// With c, another such copy of p, become c: the lines c wrote are copied
+// from it next, and stay marked.  What has been written is tracked from
+// the first reset_to() on, which copies everything, so that predictors
+// that are never reset don't pay for it; after a load or merge the next
+// one copies everything again.  The delta base and the lines
+// changed since it are those of p (or c).
+template <int MEM>
+void PredictorImpl<MEM>::reset_to(const Predictor& q, const Predictor* cq) {
+  assert(q.mem() == MEM && (!cq || cq->mem() == MEM));
+  const PredictorImpl& b=static_cast<const PredictorImpl&>(q);
+  const PredictorImpl* c=static_cast<const PredictorImpl*>(cq);
+  const PredictorImpl& p=c ? *c : b;
+  if (!t.written.on() || (c && !c->t.written.on())) {
+    *this=p;  // with the tracking of c, if any
+    if (!c) track_writes(true);
+    return;
+  }
+  memmove(t0, p.t0, T0SIZE);
+  t.reset_to(b.t, c ? &c->t : 0);
+  c0 = p.c0;
+  c4 = p.c4;
+  bcount = p.bcount;
+  sm = p.sm;
+  a1.reset_to(b.a1, c ? &c->a1 : 0);
+  a2.reset_to(b.a2, c ? &c->a2 : 0);
+  memmove(h, p.h, sizeof(h));
+  m = p.m;
+  mm.reset_to(b.mm, c ? &c->mm : 0);
+  level = p.level;
+  bytes = p.bytes;
+  pr = p.pr;
+  id = p.id;
+  base_id = p.base_id;
+  rebase_pointers(p);
+  mark_cp();
+}
+
+// Start recording the lines written for reset_to(), or stop, so that the
+// next reset_to() copies everything: loading or merging rewrites whole
+// tables without marking them.
+template <int MEM>
+void PredictorImpl<MEM>::track_writes(bool on) {
+  if (on) t.written.start();
+  else t.written.stop();
+  a1.track_writes(on);
+  a2.track_writes(on);
+  mm.track_writes(on);
+  if (on) mark_cp();
+}
+
+// Forget the changed lines: the current state is now base_id=id.
+template <int MEM>
+void PredictorImpl<MEM>::clean() {
+  base_id=id;
+  t.dirty.clear();
+  mm.clean();
+  mark_cp();
+}
+
+// The bit histories cp[] points at are written without another lookup,
+// so their lines have to stay marked
+template <int MEM>
+void PredictorImpl<MEM>::mark_cp() {
+  for (int i = 0; i < sizeof(cp)/sizeof(*cp); ++i) {
+    if (cp[i] >= t.t && cp[i] < t.t + (MEM*2+16*4)) {
+      t.dirty.mark(cp[i] - t.t);
+      t.written.mark(cp[i] - t.t);
+    }
+  }
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::set_level(int l) {
+  assert(l>=0 && l<NLEVELS);
+  assert(bcount==0);  // only on byte boundaries
+  
+  // Orders switched back on resume from the current byte context
+  int enabled=levels[l].orders&~levels[level].orders;
+  for (int i=1; i<6; ++i)
+    if (enabled>>i&1) cp[i]=t[h[i]]+1;
+  level=l;
+}
+
+// The context of one of several interleaved streams that share the
+// model: the last bytes and their hashes, the match and what the next
+// update() trains.  Loading one looks up its bit histories again, as
+// their slots may have been taken since.  Between bytes.
+template <int MEM>
+void PredictorImpl<MEM>::save_context(FILE* f) {
+  assert(bcount==0);
+  SER(c0) SER(c4) SER(h) SER(pr)
+  sm.save_scalars(f);
+  a1.save_scalars(f);
+  a2.save_scalars(f);
+  m.save_context(f);
+  mm.save_context(f);
+  SIGNATURE(0x7777)
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::load_context(FILE* f) {
+  assert(bcount==0);
+  DSER(c0) DSER(c4) DSER(h) DSER(pr)
+  sm.load_scalars(f);
+  a1.load_scalars(f);
+  a2.load_scalars(f);
+  m.load_context(f);
+  mm.load_context(f);
+  CHECKSIG(0x7777)
+  const int orders=levels[level].orders;
+  for (int i=1; i<6; ++i)
+    if (orders>>i&1) cp[i]=t[h[i]]+1;
+  cp[0]=t0+h[0]+c0;
+  id=0;
+}
+
+// Update the context hashes h[0..5] after byte c, c4 includes c
+inline void context_hashes(int c, U32 c4, U32* h) {
+  h[0]=c<<8;  // order 1
+  h[1]=(c4&0xffff)<<5|0x57000000;  // order 2
+  h[2]=(c4<<8)*3;  // order 3
+  h[3]=c4*5;  // order 4
+  h[4]=h[4]*(11<<5)+c*13&0x3fffffff;  // order 6
+  if (c>=65 && c<=90) c+=32;  // lowercase unigram word order
+  if (c>=97 && c<=122) h[5]=(h[5]+c)*(7<<3);
+  else h[5]=0;
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::prefetch(int y) const {
+  const int orders=levels[level].orders;
+  int c=c0+c0+y;
+  if (c>=256) {
+    U32 nh[6];
+    memcpy(nh, h, sizeof(nh));
+    context_hashes(c-256, c4<<8|c-256, nh);
+    for (int i=1; i<6; ++i)
+      if (orders>>i&1) t.prefetch(nh[i]);
+    mm.prefetch(c);
+  }
+  else if (bcount==3) {
+    for (int i=1; i<6; ++i)
+      if (orders>>i&1) t.prefetch(h[i]+c);
+  }
 }
 
-void Predictor::update(int y) {
-  assert(MEM>0);
+template <int MEM>
+void PredictorImpl<MEM>::update(int y) {
+  const int orders=levels[level].orders;
 
   // update model
   assert(y==0 || y==1);
-  *cp[0]=nex(*cp[0], y);
-  *cp[1]=nex(*cp[1], y);
-  *cp[2]=nex(*cp[2], y);
-  *cp[3]=nex(*cp[3], y);
-  *cp[4]=nex(*cp[4], y);
-  *cp[5]=nex(*cp[5], y);
+  id=0;
+  for (int i=0; i<6; ++i)
+    if (orders>>i&1) *cp[i]=nex(*cp[i], y);
   m.update(y);
 
   // update context
@@ -792,36 +2308,21 @@ void Predictor::update(int y) {
   if (c0>=256) {
     c0-=256;
     c4=c4<<8|c0;
-    h[0]=c0<<8;  // order 1
-    h[1]=(c4&0xffff)<<5|0x57000000;  // order 2
-    h[2]=(c4<<8)*3;  // order 3
-    h[3]=c4*5;  // order 4
-    h[4]=h[4]*(11<<5)+c0*13&0x3fffffff;  // order 6
-    if (c0>=65 && c0<=90) c0+=32;  // lowercase unigram word order
-    if (c0>=97 && c0<=122) h[5]=(h[5]+c0)*(7<<3);
-    else h[5]=0;
-    cp[1]=t[h[1]]+1;
-    cp[2]=t[h[2]]+1;
-    cp[3]=t[h[3]]+1;
-    cp[4]=t[h[4]]+1;
-    cp[5]=t[h[5]]+1;
+    ++bytes;
+    context_hashes(c0, c4, h);
+    for (int i=1; i<6; ++i)
+      if (orders>>i&1) cp[i]=t[h[i]]+1;
     c0=1;
     bcount=0;
   }
   if (bcount==4) {
-    cp[1]=t[h[1]+c0]+1;
-    cp[2]=t[h[2]+c0]+1;
-    cp[3]=t[h[3]+c0]+1;
-    cp[4]=t[h[4]+c0]+1;
-    cp[5]=t[h[5]+c0]+1;
+    for (int i=1; i<6; ++i)
+      if (orders>>i&1) cp[i]=t[h[i]+c0]+1;
   }
   else if (bcount>0) {
     int j=y+1<<(bcount&3)-1;
-    cp[1]+=j;
-    cp[2]+=j;
-    cp[3]+=j;
-    cp[4]+=j;
-    cp[5]+=j;
+    for (int i=1; i<6; ++i)
+      if (orders>>i&1) cp[i]+=j;
   }
   cp[0]=t0+h[0]+c0;
 
@@ -829,66 +2330,283 @@ void Predictor::update(int y) {
   int len=mm.p(y, m);
   int order=0;
   if (len==0) {
-    if (*cp[4]) ++order;
-    if (*cp[3]) ++order;
-    if (*cp[2]) ++order;
-    if (*cp[1]) ++order;
+    for (int i=4; i>0; --i)
+      if (orders>>i&1 && *cp[i]) ++order;
   }
   else order=5+(len>=8)+(len>=12)+(len>=16)+(len>=32);
-  m.add(stretch(sm[0].p(y, *cp[0])));
-  m.add(stretch(sm[1].p(y, *cp[1])));
-  m.add(stretch(sm[2].p(y, *cp[2])));
-  m.add(stretch(sm[3].p(y, *cp[3])));
-  m.add(stretch(sm[4].p(y, *cp[4])));
-  m.add(stretch(sm[5].p(y, *cp[5])));
+  for (int i=0; i<6; ++i)
+    m.add(orders>>i&1 ? stretch(sm.p(i, y, *cp[i])) : 0);
   m.set(order+10*(h[0]>>13));
   pr=m.p();
-  pr=pr+3*a1.pp(y, pr, c0)>>2;
-  pr=pr+3*a2.pp(y, pr, c0^h[0]>>2)>>2;
+  if (levels[level].apms>0) pr=pr+3*a1.pp(y, pr, c0)>>2;
+  if (levels[level].apms>1) pr=pr+3*a2.pp(y, pr, c0^h[0]>>2)>>2;
 }
 
+// The byte loops call update() of this final class directly, so that
+// it is inlined instead of dispatched per bit
+template <int MEM>
+void PredictorImpl<MEM>::update_bytes(const U8* buf, int n) {
+  for (int j=0; j<n; ++j)
+    for (int i=7; i>=0; --i)
+      update(buf[j]>>i&1);
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::encode(BitCoder& c, const U8* buf, int n) {
+  for (int j=0; j<n; ++j)
+    for (int i=7; i>=0; --i)
+      update(c.code(buf[j]>>i&1, pr));
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::decode(BitCoder& c, U8* buf, int n) {
+  for (int j=0; j<n; ++j) {
+    int b=1;
+    while (b<256) {
+      int y=c.code(0, pr);
+      update(y);
+      b+=b+y;
+    }
+    buf[j]=b-256;
+  }
+}
+
+template <int MEM>
+long long PredictorImpl<MEM>::cost(const U8* buf, int n, long long bound) {
+  long long s=0;
+  for (int j=0; j<n && s<=bound; ++j) {
+    for (int i=7; i>=0; --i) {
+      int y=buf[j]>>i&1;
+      s+=y ? 4096-pr : pr;
+      update(y);
+    }
+  }
+  return s;
+}
+
+template <int MEM>
+void PredictorImpl<MEM>::cost_many(Predictor* const* ps, int k, const U8* buf, int n, long long* s) {
+  PredictorImpl* const* q=(PredictorImpl* const*)ps;
+  for (int i=0; i<k; ++i) s[i]=0;
+  for (int j=0; j<n; ++j) {
+    for (int b=7; b>=0; --b) {
+      int y=buf[j]>>b&1;
+      for (int i=0; i<k; ++i) s[i]+=y ? 4096-q[i]->pr : q[i]->pr;
+      for (int i=0; i<k; ++i) q[i]->prefetch(y);
+      for (int i=0; i<k; ++i) q[i]->update(y);
+    }
+  }
+}
+
+
+// Memory options 0..9 of lpaq1_stream, 1<<20 .. 1<<29 bytes
+Predictor* new_predictor(int MEM) {
+  switch (MEM) {
+    case 1<<20: return new PredictorImpl<1<<20>();
+    case 1<<21: return new PredictorImpl<1<<21>();
+    case 1<<22: return new PredictorImpl<1<<22>();
+    case 1<<23: return new PredictorImpl<1<<23>();
+    case 1<<24: return new PredictorImpl<1<<24>();
+    case 1<<25: return new PredictorImpl<1<<25>();
+    case 1<<26: return new PredictorImpl<1<<26>();
+    case 1<<27: return new PredictorImpl<1<<27>();
+    case 1<<28: return new PredictorImpl<1<<28>();
+    case 1<<29: return new PredictorImpl<1<<29>();
+  }
+  quit("Unsupported predictor memory size (must be 1<<20 .. 1<<29)");
+  return NULL;
+}
 
 //////////////////////////////////////////////////////////////
 
 
-BitPredictor::BitPredictor(int MEM) : impl(new Predictor(MEM)) {}
+BitPredictor::BitPredictor(int MEM) : impl(new_predictor(MEM)) {}
 
 
-BitPredictor::BitPredictor(const BitPredictor& p) : impl(new Predictor(*p.impl)) { }
+BitPredictor::BitPredictor(const BitPredictor& p) : impl(p.impl->clone()) { }
   
 BitPredictor& BitPredictor::operator= (const BitPredictor& p) {
   if (&p==this) return *this;
   
-  *impl = *p.impl;
+  impl->assign(*p.impl);
   
   return *this;
 }
 
+void BitPredictor::reset_to(const BitPredictor& p) {
+  if (p.impl->mem() != impl->mem()) quit("Predictors have different memory sizes");
+  impl->reset_to(*p.impl, NULL);
+}
+
+void BitPredictor::reset_to(const BitPredictor& p, const BitPredictor& c) {
+  if (p.impl->mem() != impl->mem() || c.impl->mem() != impl->mem())
+    quit("Predictors have different memory sizes");
+  impl->reset_to(*p.impl, c.impl);
+}
+
 BitPredictor::~BitPredictor() {
   delete impl;
 }
 
-void BitPredictor::save(FILE* f) { impl->save(f); }
-void BitPredictor::load(FILE* f) { impl->load(f, true); }
+void BitPredictor::save(FILE* f) const { impl->save(f); }
+void BitPredictor::save_compact(FILE* f) const { impl->save_compact(f); }
+void BitPredictor::track_changes() { impl->track_changes(); }
+void BitPredictor::save_delta(FILE* f) { impl->save_delta(f); }
+
+// Read the state file header: returns true for the compact format
+static bool load_header(FILE* f, int& MEM) {
+  int signature=0;
+  MEM=0;
+  fread(&signature, sizeof(signature), 1, f);
+  DSER(MEM);
+  if (signature==991223) quit("This is a delta, it needs a base state");
+  if (signature!=991221 && signature!=991222)
+    quit("Not a predictor state file");
+  return signature==991222;
+}
+
+void BitPredictor::load_delta(FILE* f) {
+  int signature=0, MEM=0;
+  fread(&signature, sizeof(signature), 1, f);
+  DSER(MEM);
+  if (signature!=991223) quit("Not a predictor state delta");
+  if (MEM!=impl->mem()) quit("Delta has a different memory size");
+  impl->load_delta(f);
+}
+
+void BitPredictor::load(FILE* f) {
+  int MEM;
+  bool compact=load_header(f, MEM);
+  if (MEM!=impl->mem()) quit("State file has a different memory size");
+  if (compact) impl->load_compact(f);
+  else impl->load(f, false);
+}
 
 BitPredictor::BitPredictor(FILE* f) : impl(NULL) {
   int MEM;
+  bool compact=load_header(f, MEM);
   
-  CHECKSIG(991221)
-  DSER(MEM);
-  
-  impl = new Predictor(MEM);
-  impl->load(f, false);
+  impl = new_predictor(MEM);
+  if (compact) impl->load_compact(f);
+  else impl->load(f, false);
+}
+
+void BitPredictor::persist(const char* path) { impl->persist(path); }
+
+bool BitPredictor::full() const { return impl->full(); }
+
+bool BitPredictor::grow() {
+  if (impl->persist_file) quit("A persistent predictor can't grow");
+  Predictor* p = impl->grow();
+  if (!p) return false;
+  delete impl;
+  impl = p;
+  return true;
+}
+
+bool BitPredictor::shrink() {
+  if (impl->persist_file) quit("A persistent predictor can't shrink");
+  Predictor* p = impl->shrink();
+  if (!p) return false;
+  delete impl;
+  impl = p;
+  return true;
+}
+void BitPredictor::sync() { impl->sync(); }
+
+void BitPredictor::merge(const BitPredictor* const* ps, int n) {
+  const Predictor** q=new const Predictor*[n];
+  for (int k=0; k<n; ++k) {
+    if (ps[k]->impl->mem()!=impl->mem()) quit("Predictors to merge have different memory sizes");
+    q[k]=ps[k]->impl;
+  }
+  impl->merge(q, n);
+  delete[] q;
 }
 
 void BitPredictor::update(int y) {
   impl->update(y);
 }
 
+void BitPredictor::set_level(int level) {
+  impl->set_level(level);
+}
+
+int BitPredictor::level() const {
+  return impl->get_level();
+}
+
+void BitPredictor::save_context(FILE* f) {
+  impl->save_context(f);
+}
+
+void BitPredictor::load_context(FILE* f) {
+  impl->load_context(f);
+}
+
+void BitPredictor::update_many(BitPredictor* const* ps, const int* ys, int n) {
+  for (int i=0; i<n; ++i)
+    ps[i]->impl->prefetch(ys[i]);
+  for (int i=0; i<n; ++i)
+    ps[i]->impl->update(ys[i]);
+}
+
+void BitPredictor::update_bytes(const char* buf, int n) {
+  impl->update_bytes((const U8*)buf, n);
+}
+
+void BitPredictor::encode(BitCoder& c, const unsigned char* buf, int n) {
+  impl->encode(c, buf, n);
+}
+
+void BitPredictor::decode(BitCoder& c, unsigned char* buf, int n) {
+  impl->decode(c, buf, n);
+}
+
+long long BitPredictor::cost(const char* buf, int n, long long bound) {
+  return impl->cost((const U8*)buf, n, bound);
+}
+
+void BitPredictor::cost_many(BitPredictor* const* ps, int n, const char* buf, int len, long long* s) {
+  if (n==0) return;
+  Predictor* q[n];
+  bool same=true;
+  for (int i=0; i<n; ++i) {
+    q[i]=ps[i]->impl;
+    same=same && q[i]->mem()==q[0]->mem();
+  }
+  if (same) {
+    q[0]->cost_many(q, n, (const U8*)buf, len, s);
+    return;
+  }
+  
+  int ys[n];
+  for (int i=0; i<n; ++i) s[i]=0;
+  for (int j=0; j<len; ++j) {
+    for (int b=7; b>=0; --b) {
+      int y=buf[j]>>b&1;
+      for (int i=0; i<n; ++i) {
+        s[i]+=y ? 4096-q[i]->p() : q[i]->p();
+        ys[i]=y;
+      }
+      update_many(ps, ys, n);
+    }
+  }
+}
+
+int BitPredictor::levels() {
+  return NLEVELS;
+}
+
 int BitPredictor::MEM() const {
-  return impl->MEM;
+  return impl->mem();
 }
 
 int BitPredictor::p() const {
   return impl->p();
 }
+
+void BitPredictor::set_p(int p) {
+  assert(p>=0 && p<4096);
+  impl->pr = p;
+}
@@ -1,22 +1,133 @@
 #pragma once
 
+#include <assert.h>
+#include <limits.h>
+
 class Predictor;
 
+// The arithmetic coder of lpaq1, which BitPredictor::encode() and
+// decode() drive for whole bytes.  A subclass supplies the byte stream:
+// put(c) writes a byte when encoding, get() reads one when decoding.
+class BitCoder {
+public:
+  BitCoder(bool decoding): decoding(decoding), x1(0), x2(0xffffffff), x(0) {}
+  virtual ~BitCoder() {}
+  
+  // Encode bit y, or return the decoded bit, with probability p (12
+  // bits) that it is 1
+  int code(int y, int p) {
+    assert(p>=0 && p<4096);
+    p+=p<2048;
+    unsigned xmid=x1 + (x2-x1>>12)*p + ((x2-x1&0xfff)*p>>12);
+    assert(xmid>=x1 && xmid<x2);
+    if (decoding) y=x<=xmid;
+    y ? (x2=xmid) : (x1=xmid+1);
+    while (((x1^x2)&0xff000000)==0) {  // pass equal leading bytes of range
+      if (!decoding) put(x2>>24);
+      x1<<=8;
+      x2=(x2<<8)+255;
+      if (decoding) x=(x<<8)+get();
+    }
+    return y;
+  }
+  
+protected:
+  virtual void put(unsigned char c) = 0;
+  virtual unsigned char get() = 0;
+  
+  const bool decoding;
+  unsigned x1, x2;  // Range, initially [0, 1), scaled by 2^32
+  unsigned x;  // Decoding: last 4 input bytes
+};
+
 class BitPredictor {
 public:  
   int p() const; // probability that next bit will be 1, from 0 to 4095
+  void set_p(int p); // restore p() after a load, which leaves it at 2048
   void update(int y); // feed the next bit; y is one bit - 0 or 1
   
+  // Feed bit ys[i] to ps[i] for n independent predictors, interleaved so
+  // that their hash table misses overlap instead of stalling one by one.
+  static void update_many(BitPredictor* const* ps, const int* ys, int n);
+  
+  // The same for the bits of whole bytes, high bit first, with one call
+  // into the model instead of one per bit: update_bytes feeds them,
+  // encode and decode code them with c, cost returns what coding them
+  // would take (in 1/4096 bits, as 4096-p() for a 1 and p() for a 0).
+  // cost gives up after the byte that takes it above bound: the full
+  // cost can only be higher.
+  void update_bytes(const char* buf, int n);
+  void encode(BitCoder& c, const unsigned char* buf, int n);
+  void decode(BitCoder& c, unsigned char* buf, int n);
+  long long cost(const char* buf, int n, long long bound=LLONG_MAX);
+  
+  // cost of the same bytes for n predictors at once, s[i] for ps[i],
+  // interleaved as in update_many
+  static void cost_many(BitPredictor* const* ps, int n, const char* buf, int len, long long* s);
+  
   int MEM() const;
   
+  // Online growth: full() when the model would profit from more memory,
+  // grow() doubles MEM (between bytes; false at the largest size).  A
+  // decoder has to grow at the same point.
+  bool full() const;
+  bool grow();
+  bool shrink(); // halve MEM, e.g. to deploy a state trained with more memory
+  
+  // Speed/ratio trade-off: 0 is full lpaq1, higher levels drop models.
+  // Change only between bytes; the decoder has to follow in lockstep.
+  void set_level(int level);
+  int level() const;
+  static int levels();
+  
+  // Several interleaved streams can share one model, each with a context
+  // of its own (the last bytes, the match, the pending prediction), so
+  // that one's bytes aren't predicted from the end of another's:
+  // save_context(f) writes the current one, load_context(f) switches to
+  // one written before.  Between bytes; the tables stay shared.
+  void save_context(FILE* f);
+  void load_context(FILE* f);
+  
   BitPredictor(int MEM); // 2*(20+n) bytes
   BitPredictor(const BitPredictor& p);
   BitPredictor& operator= (const BitPredictor& p);
+  
+  // Same as *this=p, where this is a copy of p that has been updated
+  // since (or since the last reset_to(p)), but from the second call on
+  // it copies back only what the updates since the last one changed:
+  // much faster than operator= to score a short line and start over.
+  // A load or merge into this makes the next call copy everything again.
+  void reset_to(const BitPredictor& p);
+  // Same as *this=c, where this and c are both such copies of p: this
+  // takes back its own changes and takes over those of c, e.g. to score
+  // lines from a checkpoint c after their common prefix.
+  void reset_to(const BitPredictor& p, const BitPredictor& c);
   ~BitPredictor();
-  void save(FILE* f);
+  void save(FILE* f) const;
+  void save_compact(FILE* f) const; // smaller file, same state; load() reads both
   void load(FILE* f); // in-place load, without reallocations
   BitPredictor(FILE* f); // load, allocating memory
   
+  // Delta snapshots: save_delta writes only what changed since the last
+  // load (or save_delta); load_delta applies such a delta to that same
+  // state.  Changes are tracked, at a small cost per update, only after
+  // track_changes(), which has to come before that load.
+  void track_changes();
+  void save_delta(FILE* f);
+  void load_delta(FILE* f);
+  
+  // Keep the tables in a memory mapped file instead of the heap: a new
+  // file takes the current state, an existing one (from an earlier run)
+  // replaces it at no load cost.  sync() records the rest of the state
+  // in the file; call it between chunks.  No-op if not persistent.
+  void persist(const char* path);
+  void sync();
+  
+  // Become a model of what ps[0..n-1], trained on consecutive parts of
+  // the input, have seen together.  All need the same MEM as this one,
+  // which should be new and not one of them.
+  void merge(const BitPredictor* const* ps, int n);
+  
 private:
   Predictor* impl;
 };
@@ -3,82 +3,289 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <string>
+#include <vector>
 
 #include "bit_predictor.h"
+#include "prefix_batch.h"
+#include "score_cache.h"
+#include "record_reader.h"
 
 void quit(char const* m) {
     fprintf(stderr, "%s\n", m);
     _Exit(1);
 }
 
-int measure_entropy(const char* buf, int l, BitPredictor& p) {
-  int s = 0;
-  
-  for (int j=0; j<l; ++j) {
-    for (int i=7; i>=0; --i) {
-      int bit = (buf[j]>>i)&1;
-      int prediction = p.p();
-      
-      if (bit) {
-         s += 4096-prediction;
-      } else {
-         s += prediction;
-      }
-    
-      p.update(bit);
+// One round of scoring: a model per class, of which the k best go on to
+// the next stage.  The last stage has the full states and k=1.
+struct Stage {
+    int k;
+    int mem, level;            // of the cheap models
+    BitPredictor** templates;  // per class
+    BitPredictor** actives;    // copies of the templates, for scoring
+    BitPredictor** prefixes;   // with --batch: templates after a shared prefix,
+    long long* pcost;          //     its cost,
+    int* pgroup;               //     and for which group of lines
+};
+
+// Lines are scored on their first PRESCORE bytes for all candidates at
+// once, then candidate by candidate in the order of those scores: one is
+// given up as soon as it costs more than the k-th best so far.  With
+// --batch, lines sharing at least MINSHARE bytes with others of the batch
+// are scored from a checkpoint after those, see prefix_batch.h.
+enum { PRESCORE = 8, MINSHARE = 16 };
+
+// Most lines --batch reads at a time
+enum { MAXBATCH = 1 << 16 };
+
+// Working space of select() for n classes, allocated once
+struct Scratch {
+    std::vector<BitPredictor*> ps;
+    std::vector<long long> scores;
+    std::vector<int> order;
+    std::vector<int> best;            // k <= n
+    std::vector<long long> bestcost;
+    
+    Scratch(int n) : ps(n), scores(n), order(n), best(n), bestcost(n) {}
+};
+
+// Keep the st.k best of the classes cand[0..n-1] for the line in cand[],
+// best first, their costs in cost[]; returns how many.  Same result as
+// scoring every candidate in full, ties go to the lower class.  The first
+// shared bytes of the line are those of all lines of the group, scored
+// once per class into st.prefixes.
+int select(const Stage& st, const char* line, int l, int shared, int group, int* cand, int n, long long* cost,
+           Scratch& w) {
+    BitPredictor** ps = w.ps.data();
+    long long* scores = w.scores.data();
+    int* order = w.order.data();
+    int* best = w.best.data();
+    long long* bestcost = w.bestcost.data();
+    
+    for (int i=0; i<n; ++i) {
+        int c = cand[i];
+        ps[i] = st.actives[c];
+        if (!shared) {
+            ps[i]->reset_to(*st.templates[c]);
+            continue;
+        }
+        if (st.pgroup[c] != group) {
+            st.prefixes[c]->reset_to(*st.templates[c]);
+            st.pcost[c] = st.prefixes[c]->cost(line, shared);
+            st.pgroup[c] = group;
+        }
+        ps[i]->reset_to(*st.templates[c], *st.prefixes[c]);
     }
-  }
-  return s;
+    
+    int head = l < shared+PRESCORE ? l : shared+PRESCORE;
+    BitPredictor::cost_many(ps, n, line+shared, head-shared, scores);
+    if (shared)
+        for (int i=0; i<n; ++i) scores[i] += st.pcost[cand[i]];
+    
+    for (int i=0; i<n; ++i) {
+        int j = i;
+        for (; j>0 && scores[order[j-1]] > scores[i]; --j) order[j] = order[j-1];
+        order[j] = i;
+    }
+    
+    int kept = 0;
+    for (int j=0; j<n; ++j) {
+        int i = order[j];
+        long long bound = kept < st.k ? LLONG_MAX : bestcost[kept-1];
+        if (scores[i] > bound) break;
+        long long s = scores[i] + ps[i]->cost(line+head, l-head, bound-scores[i]);
+        
+        if (kept == st.k && (s > bound || (s == bound && cand[i] > best[kept-1]))) continue;
+        if (kept < st.k) ++kept;
+        int m = kept-1;
+        for (; m>0 && (bestcost[m-1] > s || (bestcost[m-1] == s && best[m-1] > cand[i])); --m) {
+            best[m] = best[m-1];
+            bestcost[m] = bestcost[m-1];
+        }
+        best[m] = cand[i];
+        bestcost[m] = s;
+    }
+    
+    memmove(cand, best, kept*sizeof(*cand));
+    memmove(cost, bestcost, kept*sizeof(*cost));
+    return kept;
+}
+
+// Cheap model for a pre-screening stage: p shrunk to memory option mem,
+// like shrinkstate does, and set to the model level
+BitPredictor* cheap_model(const BitPredictor& p, int mem, int level) {
+    BitPredictor* q = new BitPredictor(p);
+    while (q->MEM() > 1 << (mem + 20) && q->shrink()) {}
+    q->set_level(level);
+    return q;
 }
 
 int main(int argc, char* argv[]) {
     if (argc==1 || !strcmp(argv[1], "--help")) {
-        fprintf(stdout, "Usage: classify class1.lpaq1state class2.lpaq1state ... < input.txt > classified.txt\n");
+        fprintf(stdout, "Usage: classify [--cascade=N:k[:L],...] [--check] [--batch=n] [--cache=n] [--records=nul|length] class1.lpaq1state class2.lpaq1state ... < input.txt > classified.txt\n");
         fprintf(stdout, "    This tool loads lpaq1_stream savestates and classifies input lines (checks in which class it is more compressible)\n");
+        fprintf(stdout, "    --cascade first scores each line with cheap copies of the states, shrunk to memory\n"
+                        "        option N and at model level L (default 0), and only the k best classes go on to\n"
+                        "        the next stage; the last one uses the full states.  Stages are separated by commas.\n");
+        fprintf(stdout, "    --check also scores every class with the full states and reports on stderr how\n"
+                        "        many lines the cascade classified differently.\n");
+        fprintf(stdout, "    --batch reads n lines (up to %d) at a time and scores prefixes (of at least %d bytes)\n"
+                        "        that lines of the batch share only once.  Takes a third copy of each state.\n",
+                MAXBATCH, MINSHARE);
+        fprintf(stdout, "    --cache keeps the class of the last n distinct lines and gives it to a repeated\n"
+                        "        line without scoring it again; hits and misses are reported on stderr.\n");
+        fprintf(stdout, "    --records=nul reads NUL terminated records instead of lines, --records=length ones\n"
+                        "        after a 4-byte big-endian length; they are written back the same way.\n");
         return 1;
     }
     
-    struct {
-        BitPredictor *template_;
-        BitPredictor *active_;
-        const char* name;
-        int s;
-    } a[argc-1];
+    int argi = 1;
+    const char* cascade = "";
+    bool check = false;
+    int batch = 1;
+    long cache_size = -1;
+    int format = RecordReader::NEWLINE;
+    for (; argi<argc && !strncmp(argv[argi], "--", 2); ++argi) {
+        if (!strncmp(argv[argi], "--cascade=", strlen("--cascade="))) cascade = argv[argi] + strlen("--cascade=");
+        else if (!strcmp(argv[argi], "--check")) check = true;
+        else if (!strncmp(argv[argi], "--batch=", strlen("--batch="))) batch = atoi(argv[argi] + strlen("--batch="));
+        else if (!strncmp(argv[argi], "--cache=", strlen("--cache="))) cache_size = atol(argv[argi] + strlen("--cache="));
+        else if (!strncmp(argv[argi], "--records=", strlen("--records="))) {
+            format = RecordReader::format(argv[argi] + strlen("--records="));
+            if (format < 0) quit("Bad --records, expected newline, nul or length");
+        }
+        else quit("Unknown option");
+    }
+    
+    int n = argc-argi;
+    if (n < 1) quit("No classes");
+    char** names = argv+argi;
     
-    for (int i=1; i<argc; ++i) {
-        auto & c = a[i-1];
-        c.name = argv[i];
-        
-        FILE* f = fopen(argv[i], "rb");
-        assert(f);
+    enum { MAXSTAGES = 8 };
+    Stage stages[MAXSTAGES+1] = {};
+    int nstages = 0;
+    for (const char* c = cascade; *c; ) {
+        int mem, k, level = 0, used = 0;
+        if (sscanf(c, "%d:%d%n:%d%n", &mem, &k, &used, &level, &used) < 2 || mem < 0 || mem > 9 || k < 1
+                || level < 0 || level >= BitPredictor::levels())
+            quit("Bad --cascade, expected N:k or N:k:L stages separated by commas");
+        if (nstages == MAXSTAGES) quit("Too many cascade stages");
+        c += used;
+        if (*c == ',') ++c;
+        else if (*c) quit("Bad --cascade, expected N:k or N:k:L stages separated by commas");
         
-        c.template_ = new BitPredictor(f);
-        c.active_ = new BitPredictor(c.template_->MEM());
+        Stage& st = stages[nstages++];
+        st.k = k < n ? k : n;
+        st.mem = mem;
+        st.level = level;
     }
     
-    while(!feof(stdin)) { 
-        char line[655360]; 
-        if(!fgets(line, sizeof line-1, stdin)) break; 
-        line[sizeof(line)-1]=0; 
-        int l = strlen(line);
-        
-        int minimum_entropy = INT_MAX;
-        const char* best_name = "unknown";
+    Stage& full = stages[nstages];
+    full.k = 1;
+    full.templates = new BitPredictor*[n];
+    full.actives = new BitPredictor*[n];
+    for (int i=0; i<n; ++i) {
+        FILE* f = fopen(names[i], "rb");
+        if (!f) quit("Can't open state file");
+        full.templates[i] = new BitPredictor(f);
+        fclose(f);
+        full.actives[i] = new BitPredictor(*full.templates[i]);
+    }
+    
+    for (int s=0; s<nstages; ++s) {
+        Stage& st = stages[s];
+        st.templates = new BitPredictor*[n];
+        st.actives = new BitPredictor*[n];
+        for (int i=0; i<n; ++i) {
+            st.templates[i] = cheap_model(*full.templates[i], st.mem, st.level);
+            st.actives[i] = new BitPredictor(*st.templates[i]);
+        }
+    }
+    
+    if (batch < 1 || batch > MAXBATCH) quit("Bad --batch");
+    if (cache_size == 0 || cache_size < -1) quit("Bad --cache");
+    
+    // The class of a line, and with --check the one scoring every class in full gave
+    struct Result {
+        int cls, full;
+    };
+    ScoreCache<Result> cache(cache_size > 0 ? cache_size : 0);
+    if (batch > 1) {
+        for (int s=0; s<=nstages; ++s) {
+            Stage& st = stages[s];
+            st.prefixes = new BitPredictor*[n];
+            st.pcost = new long long[n];
+            st.pgroup = new int[n];
+            for (int i=0; i<n; ++i) {
+                st.prefixes[i] = new BitPredictor(*st.templates[i]);
+                st.pgroup[i] = -1;
+            }
+        }
+    }
+    
+    std::vector<int> cand(n);
+    std::vector<long long> cost(n);
+    Scratch scratch(n);
+    long total = 0, disagreements = 0;
+    int group = 0;
+    
+    std::vector<const char*> lines(batch);
+    std::vector<size_t> sizes(batch);
+    std::vector<int> lens(batch), order(batch), gstart(batch+1), glen(batch), result(batch);
+    
+    RecordReader reader(0, RecordReader::Format(format));
+    for (;;) { 
+        int nlines = reader.read(lines.data(), sizes.data(), batch);
+        if (nlines == 0) break;
+        for (int j=0; j<nlines; ++j) {
+            if (sizes[j] > INT_MAX) quit("Record too long");
+            lens[j] = sizes[j];
+        }
         
-        for (int i=1; i<argc; ++i) {
-            auto & c = a[i-1];
-            *c.active_ = *c.template_;
-            c.s = measure_entropy(line, l, *c.active_);
-            
-            if (minimum_entropy > c.s) {
-                minimum_entropy = c.s;
-                best_name = c.name;
+        int groups = prefix_groups(lines.data(), lens.data(), nlines, MINSHARE, order.data(), gstart.data(), glen.data());
+        for (int g=0; g<groups; ++g, ++group) {
+            for (int o=gstart[g]; o<gstart[g+1]; ++o) {
+                int j = order[o];
+                Result r;
+                
+                if (cache.get(lines[j], lens[j], r)) {
+                    result[j] = r.cls;
+                    if (check) {
+                        ++total;
+                        if (r.full != r.cls) ++disagreements;
+                    }
+                    continue;
+                }
+                
+                int m = n;
+                for (int i=0; i<n; ++i) cand[i] = i;
+                for (int s=0; s<=nstages; ++s)
+                    m = select(stages[s], lines[j], lens[j], glen[g], group, cand.data(), m, cost.data(), scratch);
+                r.cls = result[j] = cand[0];
+                r.full = -1;
+                
+                if (check) {
+                    m = n;
+                    for (int i=0; i<n; ++i) cand[i] = i;
+                    select(full, lines[j], lens[j], glen[g], group, cand.data(), m, cost.data(), scratch);
+                    ++total;
+                    if (cand[0] != result[j]) ++disagreements;
+                    r.full = cand[0];
+                }
+                cache.put(lines[j], lens[j], r);
             }
         }
         
-        fprintf(stdout, "%s ", best_name);
-        fwrite(line, 1, l, stdout);
-        fflush(stdout);
+        for (int j=0; j<nlines; ++j) {
+            std::string head = std::string(names[result[j]]) + " ";
+            RecordReader::put(stdout, RecordReader::Format(format), head.data(), head.size(), lines[j], lens[j]);
+            fflush(stdout);
+        }
     }
+    
+    if (check)
+        fprintf(stderr, "%ld of %ld lines classified differently than by scoring every class in full\n", disagreements, total);
+    if (cache_size > 0)
+        fprintf(stderr, "cache: %ld hits, %ld misses\n", cache.hits, cache.misses);
     return 0;
 }
@@ -164,10 +164,28 @@ To compile (g++ 3.4.5, upx 3.00w):
 #include <ctype.h>
 //#define NDEBUG  // remove for debugging
 #include <assert.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "bit_predictor.h"
+#include "prefix_batch.h"
+#include "score_cache.h"
+#include "record_reader.h"
+#include "predictor_pool.h"
 
 // 8, 16, 32 bit unsigned types (adjust as appropriate)
 typedef unsigned char  U8;
@@ -189,32 +207,28 @@ template <class T> void alloc(T*&p, int n) {
 
 //////////////////////////// Encoder ////////////////////////////
 
-// An Encoder does arithmetic encoding.  Methods:
+// An Encoder is the BitCoder of a stream chunk.  Methods:
 // Encoder(COMPRESS, f) creates encoder for compression to archive f, which
 //     must be open past any header for writing in binary mode.
 // Encoder(DECOMPRESS, f) creates encoder for decompression from archive f,
 //     which must be open past any header for reading in binary mode.
-// code(i) in COMPRESS mode compresses bit i (0 or 1) to file f.
-// code() in DECOMPRESS mode returns the next decompressed bit from file f.
-// compress(c) in COMPRESS mode compresses one byte.
-// decompress() in DECOMPRESS mode decompresses and returns one byte.
+// compress(buf, n) in COMPRESS mode compresses n bytes.
+// decompress(buf, n) in DECOMPRESS mode decompresses n bytes to buf.
 // flush() should be called exactly once after compression is done and
 //     before closing f.  It does nothing in DECOMPRESS mode.
+// use(p) makes the following bits predicted by p instead.
 
 
 typedef enum {COMPRESS, DECOMPRESS} Mode;
-class Encoder {
+class Encoder : public BitCoder {
 public:
   bool stopflag;
   bool ffff_attention;
 private:
-  BitPredictor &predictor;
-  const Mode mode;       // Compress or decompress?
+  BitPredictor *predictor;
   FILE* archive;         // Compressed data file
-  U32 x1, x2;            // Range, initially [0, 1), scaled by 2^32
-  U32 x;                 // Decompress mode: last 4 input bytes of archive
 
-  unsigned char getchar() {
+  unsigned char get() {
     if (this->stopflag) return 255;
       
     unsigned char c = getc(archive);
@@ -254,7 +268,7 @@ private:
     return c;*/
   }
   
-  void putchar(unsigned char c) {
+  void put(unsigned char c) {
     if (c==0xFF && !ffff_attention) {
       putc(0xFF, archive);
       ffff_attention=true;
@@ -273,62 +287,64 @@ private:
     }
   }
 
-  // Compress bit y or return decompressed bit
-  int code(int y=0) {
-    int p=predictor.p();
-    assert(p>=0 && p<4096);
-    p+=p<2048;
-    U32 xmid=x1 + (x2-x1>>12)*p + ((x2-x1&0xfff)*p>>12);
-    assert(xmid>=x1 && xmid<x2);
-    if (mode==DECOMPRESS) y=x<=xmid;
-    y ? (x2=xmid) : (x1=xmid+1);
-    predictor.update(y);
-    while (((x1^x2)&0xff000000)==0) {  // pass equal leading bytes of range
-      if (mode==COMPRESS) {
-        unsigned char c = (x2>>24);
-        this->putchar(c);
-      }
-      x1<<=8;
-      x2=(x2<<8)+255;
-      if (mode==DECOMPRESS) {
-        unsigned char c = this->getchar();
-        x=(x<<8)+(c&255);  // EOF is OK
-      }
-    }
-    return y;
-  }
-
 public:
   Encoder(Mode m, FILE* f, BitPredictor& pred);
   void flush();  // call this when compression is finished
+  void use(BitPredictor& pred) { predictor=&pred; }
 
-  // Compress one byte
-  void compress(int c) {
-    assert(mode==COMPRESS);
-    for (int i=7; i>=0; --i)
-      code((c>>i)&1);
+  // Compress n bytes
+  void compress(const unsigned char* buf, int n) {
+    assert(!decoding);
+    predictor->encode(*this, buf, n);
   }
 
-  // Decompress and return one byte
-  int decompress() {
-    int c=0;
-    for (int i=0; i<8; ++i)
-      c+=c+code();
-    return c;
+  // Decompress n bytes to buf
+  void decompress(unsigned char* buf, int n) {
+    predictor->decode(*this, buf, n);
+  }
+  
+  // Compress n, or return a decompressed number, in unary without the
+  // model: each bit with probability *p of a 1, which adapts the same
+  // way on both sides
+  int count(int n, int* p) {
+    for (int k=0; ; ++k) {
+      int y=code(k<n, *p);
+      adapt(p, y);
+      if (!y) return k;
+    }
+  }
+  
+  // Compress c, or return a decompressed number, in bits bits without the
+  // model: by a binary tree of probabilities p[1..2^bits), adapting as in
+  // count()
+  int symbol(int c, int bits, int* p) {
+    int k=1;
+    for (int i=bits-1; i>=0; --i) {
+      int y=code((c>>i)&1, p[k]);
+      adapt(&p[k], y);
+      k+=k+y;
+    }
+    return k-(1<<bits);
+  }
+  
+  static void adapt(int* p, int y) {
+    *p+=((y<<12)-*p)>>4;
+    if (*p<32) *p=32;
+    if (*p>4064) *p=4064;
   }
 };
 
 Encoder::Encoder(Mode m, FILE* f, BitPredictor& pred):
-    stopflag(false), ffff_attention(false), mode(m), archive(f), x1(0), x2(0xffffffff), x(0), predictor(pred) {
-  if (mode==DECOMPRESS) {  // x = first 4 bytes of archive
+    BitCoder(m==DECOMPRESS), stopflag(false), ffff_attention(false), predictor(&pred), archive(f) {
+  if (decoding) {  // x = first 4 bytes of archive
     for (int i=0; i<4; ++i)
-      x=(x<<8)+(this->getchar()&255);
+      x=(x<<8)+get();
   }
 }
 
 void Encoder::flush() {
-  if (mode==COMPRESS)
-    this->putchar(x1>>24);  // Flush first unequal byte of range
+  if (!decoding)
+    put(x1>>24);  // Flush first unequal byte of range
 }
 
 
@@ -340,70 +356,748 @@ int getmem(unsigned char mem) {
   return 1<<(mem-'0'+20);
 }
 
-void do_compress(FILE* in, FILE* out, unsigned char mem, BitPredictor& predictor) {
-    fprintf(out, "pQS%c", mem);
-    fflush(out);
+// The value of environment variable name, which is set, or -1 if it
+// isn't all a finite number
+double env_number(const char* name) {
+  const char* s = getenv(name);
+  char* end;
+  double x = strtod(s, &end);
+  return end==s || *end || !isfinite(x) ? -1 : x;
+}
 
-    for(;;) {
-      int ret = fread(&buffer, 1, sizeof buffer, in);
-      if (ret==0 || ret==-1) {
-        break;
-      }
+// Stream header: "pQS" and the memory option '0'..'9'.  Streams that
+// need control records (e.g. a non-default model level) use "pQX"
+// instead, so that older decoders refuse them instead of misdecoding.
+// One direction of --duplex is "pQD", a --mux stream "pQM".
+//
+// Control record: 0xFE 0xFF op arg.  0xFE 0xFF would be a chunk of
+// length 0x3EFF, which is longer than buffer and never written.
+//   'L' '0'+n  - switch the predictor to model level n (in the header,
+//                and between chunks when TARGET_MBPS/TARGET_LATENCY is set)
+//   'G' '0'+n  - grow the predictor to memory option n, double the
+//                current size (between chunks when GROW is set)
+//   'A' n      - --duplex: the other end primed n more chunks, see Duplex
+//   'E' n      - --mux: channel n has ended
+//   'M' 'S'/'O'- --mux: the channels share a model or have their own (header)
+//   'K' '0'+n  - keyframe of memory option n, see Keyframes
+
+void put_control(FILE* out, int op, int arg) {
+    putc(0xFE, out);
+    putc(0xFF, out);
+    putc(op, out);
+    putc(arg, out);
+}
+
+// 0xxxxxxx one plain byte
+// 10xxxxxx len up to 64
+// 11xxxxxx len up to 2^(6+8) == 16384
+// 0xFE 0xFF op arg control record, see put_control
+
+// Whether a chunk of n bytes is written as it is: a few bytes that are
+// all plain ones (after the first, which can't be a control record)
+bool plain_chunk(const unsigned char* buf, int n) {
+    if (n>=7) return false;
+    for (int i=1; i<n; ++i) {
+      if (buf[i]>=0x80) return false;
+    }
+    return true;
+}
+
+// Length in front of a compressed chunk
+void put_length(FILE* out, int n) {
+    if(n<64) {
+      unsigned char c = n | 0x80;
+      putc(c, out);
+    } else {
+      int c = (n >> 8) | 0xC0;
+      int d = n & 0xFF;
+      putc(c, out); // maximum 0xFE
+      putc(d, out); // maximum 0xFE
+    }
+}
+
+// Throughput governor for adaptive compression.  After each chunk it
+// is told the bytes, CPU seconds and whether more input was already
+// waiting.  While input backs up and the current level is slower than
+// the target (seconds per byte), it steps to a cheaper level; when the
+// backlog is gone, or the next richer level is known to be fast enough,
+// it steps back towards the requested level.  Estimates of levels not
+// in use decay slowly, so that a richer level is retried from time to
+// time (the first chunks also pay for page faults of fresh tables).
+struct Governor {
+    double target;   // allowed seconds per byte, 0 = governor off
+    double cost[16]; // running average of seconds per byte for each level, 0 = not measured
+    int min_level;   // the requested level, never go below it
+    
+    Governor(double target, int level) : target(target), min_level(level) {
+      memset(cost, 0, sizeof(cost));
+    }
+    
+    // CPU seconds of this thread only: clock() would also count the
+    // warm-up and --duplex receiver threads
+    static double seconds() {
+      struct timespec ts;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+      return ts.tv_sec + ts.tv_nsec*1e-9;
+    }
+    
+    int next(int level, int bytes, double seconds, bool backlog) {
+      double c = seconds/bytes;
+      for (int i=0; i<16; ++i) cost[i] *= 0.98;
+      cost[level] = cost[level] ? cost[level]/0.98*0.75 + c*0.25 : c;
       
-      // 0xxxxxxx one plain byte
-      // 10xxxxxx len up to 64
-      // 11xxxxxx len up to 2^(6+8) == 16384
+      if (backlog && cost[level] > target && level+1 < BitPredictor::levels()) {
+        return level+1;
+      }
+      if (level > min_level && (!backlog || (cost[level-1] && cost[level-1]*1.2 < target))) {
+        return level-1;
+      }
+      return level;
+    }
+};
+
+// Background checkpoints of the predictor.  Between chunks, once
+// interval seconds have passed since the last one, poll() forks: the
+// child owns a copy-on-write snapshot of the predictor, saves it to
+// path.tmp and renames that over path, while the parent carries on with
+// the next chunk.  At most one child runs at a time; a checkpoint due
+// while one is still writing waits for the next chunk.
+struct Checkpointer {
+    const char* path;  // NULL = no checkpoints
+    bool compact;      // SAVE_FORMAT=compact
+    double interval;   // seconds
+    double last;       // time of the last checkpoint
+    pid_t child;       // writing child, 0 if none
+    
+    Checkpointer() : path(NULL), compact(false), interval(60), last(now()), child(0) {}
+    
+    static double now() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec + ts.tv_nsec*1e-9;
+    }
+    
+    void reap(bool wait) {
+      if (!child) return;
+      int status;
+      pid_t r = waitpid(child, &status, wait ? 0 : WNOHANG);
+      if (r == 0) return;
+      if (r == child && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+        fprintf(stderr, "Checkpoint to %s failed\n", path);
+      }
+      child = 0;
+    }
+    
+    void poll(BitPredictor& predictor) {
+      if (!path) return;
+      reap(false);
+      if (child || now()-last < interval) return;
+      last = now();
+      fflush(NULL);  // nothing buffered may be written twice
+      pid_t pid = fork();
+      if (pid == -1) {
+        perror("fork");
+        return;
+      }
+      if (pid == 0) {
+        char tmp[4096];
+        snprintf(tmp, sizeof tmp, "%s.tmp", path);
+        FILE* f = fopen(tmp, "wb");
+        if (!f) _exit(1);
+        if (compact) predictor.save_compact(f);
+        else predictor.save(f);
+        if (fclose(f) || rename(tmp, path)) _exit(1);
+        _exit(0);
+      }
+      child = pid;
+    }
+} checkpointer;
+
+// LOAD and PRELOAD fill the predictor on a thread of their own, so that
+// startup doesn't hold up the input: -c and -d take and pass on what needs
+// no model (the header, short plain chunks) meanwhile.  Nothing else may
+// touch the predictor before wait(), not even to read its memory option:
+// PRELOAD grows it at the G records of its stream, replacing the model.
+struct Warmup {
+    std::thread thread;
+    unsigned char mem;  // memory option of the predictor, unless it grows
+    bool grows;         // PRELOAD may grow the predictor
+    
+    void start(std::function<void()> load, unsigned char m, bool g) {
+      mem = m;
+      grows = g;
+      thread = std::thread(load);
+    }
+    // At once on the warm-up thread itself, whose PRELOAD runs do_decompress
+    void wait() {
+      if (thread.joinable() && thread.get_id() != std::this_thread::get_id()) thread.join();
+    }
+    // quit() on the warm-up thread exits without it
+    ~Warmup() { if (thread.joinable()) thread.detach(); }
+} warmup;
+
+// RESUME=file lets --analyse and --filter over a growing file go on where
+// the last run stopped: the file keeps the P and C models with their
+// next prediction, how far the input was read and which input that was
+// (device, inode, and its size then).  Another file, or one that has
+// shrunk since, starts over.  FOLLOW=seconds waits for more input at its
+// end instead of stopping, like tail -f, until interrupted; when the file
+// shrinks meanwhile (it was truncated, e.g. by logrotate's copytruncate)
+// it goes on from its start with the same models.
+volatile sig_atomic_t interrupted = 0;
+
+void on_interrupt(int) { interrupted = 1; }
+
+struct Resume {
+    enum { SIGNATURE = 991225, OLD_SIGNATURE = 991224 };
+    struct Header {
+      int signature;
+      int nruns;
+      char modes[16];
+      long long dev, ino, size, offset;
+    };
+    
+    const char* path;  // NULL = no resume file
+    bool compact;      // SAVE_FORMAT=compact
+    double follow;     // seconds between polls at the end of input, 0 = stop there
+    off_t offset;      // input bytes done
+    off_t saved;       // offset at the last save, -1 if none
+    
+    Resume() : path(NULL), compact(false), follow(0), offset(0), saved(-1) {}
+    
+    bool active() const { return path || follow; }
+    
+    // Set the models of the run modes and the offset to where the last
+    // run stopped, if the file is from such a run over this input
+    void start(FILE* in, const char* modes, BitPredictor* const* runs, int nruns) {
+      struct stat st;
+      if (fstat(fileno(in), &st) || !S_ISREG(st.st_mode)) quit("RESUME and FOLLOW need a regular file as input");
+      if (follow) {
+        signal(SIGINT, on_interrupt);
+        signal(SIGTERM, on_interrupt);
+      }
+      if (!path) return;
+      FILE* f = fopen(path, "rb");
+      if (!f) return;  // first run
       
-      bool smallthing = false;
+      Header h;
+      if (fread(&h, sizeof h, 1, f) != 1 || (h.signature != SIGNATURE && h.signature != OLD_SIGNATURE))
+        quit("Not a RESUME file");
+      if (strncmp(h.modes, modes, sizeof h.modes) || h.nruns != nruns) quit("RESUME file is from other modes");
+      if (h.signature == OLD_SIGNATURE) {
+        fprintf(stderr, "%s: RESUME file is from an older version, starting over\n", path);
+      } else
+      if (h.dev != st.st_dev || h.ino != st.st_ino || h.size > st.st_size) {
+        fprintf(stderr, "%s: input was replaced or truncated, starting over\n", path);
+      } else {
+        for (int k=0; k<nruns; ++k) {
+          runs[k]->load(f);
+          int p;
+          if (fread(&p, sizeof p, 1, f) != 1 || p < 0 || p >= 4096) quit("Corrupt RESUME file");
+          runs[k]->set_p(p);
+        }
+        offset = saved = h.offset;
+      }
+      fclose(f);
+    }
+    
+    void save(FILE* in, const char* modes, BitPredictor* const* runs, int nruns) {
+      if (!path || offset == saved) return;
+      struct stat st;
+      if (fstat(fileno(in), &st)) quit("Can't stat the input");
+      Header h;
+      memset(&h, 0, sizeof h);
+      h.signature = SIGNATURE;
+      h.nruns = nruns;
+      strncpy(h.modes, modes, sizeof h.modes);
+      h.dev = st.st_dev;
+      h.ino = st.st_ino;
+      h.size = st.st_size;
+      h.offset = offset;
       
-      if(ret<7) {
-        smallthing=true;
-        int i;
-        for (i=1; i<ret; ++i) {
-          if (buffer[i]>=0x80) smallthing=false;
+      char tmp[4096];
+      snprintf(tmp, sizeof tmp, "%s.tmp", path);
+      FILE* f = fopen(tmp, "wb");
+      if (!f) quit("Can't open RESUME file");
+      fwrite(&h, sizeof h, 1, f);
+      for (int k=0; k<nruns; ++k) {
+        if (compact) runs[k]->save_compact(f);
+        else runs[k]->save(f);
+        int p = runs[k]->p();
+        fwrite(&p, sizeof p, 1, f);
+      }
+      if (fclose(f) || rename(tmp, path)) quit("Can't write RESUME file");
+      saved = offset;
+    }
+    
+    // At the end of input: false to stop, true when there may be more,
+    // from offset on
+    bool wait(FILE* in) {
+      if (!follow || interrupted) return false;
+      struct timespec ts;
+      ts.tv_sec = (time_t)follow;
+      ts.tv_nsec = (long)((follow - ts.tv_sec)*1e9);
+      nanosleep(&ts, NULL);
+      if (interrupted) return false;
+      struct stat st;
+      if (fstat(fileno(in), &st)) quit("Can't stat the input");
+      if (st.st_size < offset) {
+        fprintf(stderr, "Input was truncated, reading it from the start\n");
+        offset = 0;
+      }
+      return true;
+    }
+} resume;
+
+// Memory option '0'..'9' of a predictor
+unsigned char memopt(const BitPredictor& predictor) {
+  unsigned char m = '0';
+  while (getmem(m) < predictor.MEM()) ++m;
+  return m;
+}
+
+// The memory option the predictor has after the warm-up, for a header:
+// known at once unless PRELOAD may grow it, else after waiting for it
+unsigned char warm_memopt(const BitPredictor& predictor) {
+  if (warmup.grows) warmup.wait();  // at once on the warm-up thread
+  bool running = warmup.thread.joinable() && warmup.thread.get_id() != std::this_thread::get_id();
+  return running ? warmup.mem : memopt(predictor);
+}
+
+// Both directions of a connection over one transport (--duplex=fd): this
+// end compresses its input to it with the outgoing model and decompresses
+// what comes from it with the incoming one, on a thread of its own.  The
+// directions help each other: before each chunk an end sends, it feeds
+// what it has received since into its outgoing model (primes it), and
+// starts the chunk with how many chunks that was, coded in a few bits.
+// The other end primes its incoming model with the same chunks of its own
+// at the same point, so the two copies of each model see the same bytes in
+// the same order.  An end that receives a lot without sending primes and
+// says so with an 'A' control record ("primed n more of your chunks"), so
+// that the other end need not keep what it sent for long.  Short plain
+// chunks go past the models as always.
+struct Duplex {
+    enum { BACKLOG = 255 };  // chunks received before an 'A' record
+    int wake[2];  // pipe: the receiver has chunks for the sender to prime
+    std::mutex lock;
+    std::deque<std::string> received;  // not yet primed into the outgoing model
+    std::deque<std::string> sent;      // not yet primed into the incoming model
+    int ackp_out, ackp_in;             // for Encoder::count()
+    
+    Duplex() : ackp_out(2048), ackp_in(2048) {
+      if (pipe(wake)) quit("pipe failed");
+      fcntl(wake[0], F_SETFL, O_NONBLOCK);
+      fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    }
+    
+    static void prime(BitPredictor& predictor, const std::string& s) {
+      predictor.update_bytes(s.data(), s.size());
+    }
+    
+    // Sender: a chunk about to go out, and priming the outgoing model,
+    // returning with how many chunks
+    void sending(const unsigned char* buf, int n) {
+      std::lock_guard<std::mutex> l(lock);
+      sent.push_back(std::string((const char*)buf, n));
+    }
+    size_t backlog() {
+      char c[64];
+      while (read(wake[0], c, sizeof c) == sizeof c) {}
+      std::lock_guard<std::mutex> l(lock);
+      return received.size();
+    }
+    int prime_received(BitPredictor& outgoing) {
+      int n = 0;
+      for (;;) {
+        std::string s;
+        {
+          std::lock_guard<std::mutex> l(lock);
+          if (received.empty()) return n;
+          s.swap(received.front());
+          received.pop_front();
+        }
+        prime(outgoing, s);
+        ++n;
+      }
+    }
+    
+    // Receiver: a chunk came in, and the other end primed n of ours
+    void got(const unsigned char* buf, int n) {
+      {
+        std::lock_guard<std::mutex> l(lock);
+        received.push_back(std::string((const char*)buf, n));
+      }
+      if (write(wake[1], "", 1) < 0 && errno != EAGAIN) quit("Can't wake the sender");
+    }
+    void acked(BitPredictor& incoming, int n) {
+      while (n--) {
+        std::string s;
+        {
+          std::lock_guard<std::mutex> l(lock);
+          if (sent.empty()) quit("Bad duplex acknowledgement");
+          s.swap(sent.front());
+          sent.pop_front();
+        }
+        prime(incoming, s);
+      }
+    }
+};
+
+// 'A' control records for n primed chunks
+void put_acks(FILE* out, int n) {
+  for (; n > 0; n -= 255) put_control(out, 'A', n < 255 ? n : 255);
+}
+
+// Several sources in one stream (--mux, --demux), so that sources sharing
+// a pipe don't spoil each other's contexts as when their lines are
+// interleaved.  With a shared model (the default) all channels go through
+// the loaded one, each with a context of its own (see
+// BitPredictor::save_context), so they still learn from each other; with
+// own models (MUX_MODEL=own) each channel gets a copy of the loaded one at
+// its first compressed chunk and keeps to itself; with POOL=n[:MB] the
+// copies come from a PredictorPool, which keeps up to n (that fit in MB)
+// ready and resets those of ended channels in the background.  A compressed chunk
+// starts with its channel, coded in a few bits given the channel of the
+// chunk before (sources often take turns).  Plain bytes belong to the
+// channel of the compressed chunk before them, so a short chunk of
+// another channel is compressed too.  Channels are numbered from 0 in the
+// order of the file descriptors given to --mux (inputs) and --demux
+// (outputs), up to 256 of them.
+struct Mux {
+    enum { CHANNELS = 256 };
+    std::vector<int> fds;
+    std::vector<FILE*> files;           // --demux outputs, NULL when ended
+    bool shared;
+    bool started;                       // a chunk has been compressed
+    std::vector<BitPredictor*> models;  // own models, NULL until the first chunk
+    std::vector<std::string> contexts;  // shared model: of each channel, "" if new
+    std::string initial;                // shared model: the context after LOAD
+    int owner;                          // shared model: whose context it has, or -1
+    int channel;                        // of the last compressed chunk, or -1
+    std::vector<int> channelp;          // for Encoder::symbol(), per previous channel
+    size_t pool_size, pool_bytes;       // own models: POOL=n[:MB], 0 = no pool
+    PredictorPool* pool;                // of copies of the loaded model, from the first one
+    
+    // fds from a list like "3,4,5"; for output, open them for writing
+    Mux(const char* list, bool output) : shared(true), started(false), owner(-1), channel(-1),
+        channelp((CHANNELS+1)*CHANNELS, 2048), pool_size(0), pool_bytes(0), pool(NULL) {
+      for (const char* s = list; ; ++s) {
+        char* e;
+        long fd = strtol(s, &e, 10);
+        if (e == s || fd < 0 || (*e && *e != ',')) quit("Bad --mux or --demux file descriptor list");
+        fds.push_back(fd);
+        s = e;
+        if (!*s) break;
+      }
+      if (fds.size() > CHANNELS) quit("Too many channels (at most 256)");
+      for (size_t k=0; k<fds.size(); ++k) {
+        FILE* f = NULL;
+        if (output && !(f = fdopen(fds[k], "wb"))) quit("Bad --demux file descriptor");
+        files.push_back(f);
+        models.push_back(NULL);
+        contexts.push_back("");
+      }
+    }
+    ~Mux() {
+      for (size_t k=0; k<fds.size(); ++k) end(k);
+      delete pool;
+    }
+    
+    // The model to compress a chunk of channel k with
+    BitPredictor& model(int k, BitPredictor& base) {
+      started = true;
+      if (!shared) {
+        if (!models[k]) {
+          if (!pool && pool_size) start_pool(base);
+          models[k] = pool ? pool->acquire() : new BitPredictor(base);
+        }
+        return *models[k];
+      }
+      if (initial.empty()) initial = save_context(base);
+      if (owner != k) {
+        if (owner >= 0) contexts[owner] = save_context(base);
+        const std::string& s = contexts[k].empty() ? initial : contexts[k];
+        FILE* f = fmemopen((void*)s.data(), s.size(), "rb");
+        if (!f) quit("fmemopen failed");
+        base.load_context(f);
+        fclose(f);
+        owner = k;
+      }
+      return base;
+    }
+    // The pool, once base is loaded.  Only the ready predictors count
+    // against MB: acquire() must not wait for a channel to end.
+    void start_pool(const BitPredictor& base) {
+      size_t fit = pool_bytes / PredictorPool::footprint(base.MEM());
+      if (pool_bytes && pool_size > fit) pool_size = fit ? fit : 1;
+      pool = new PredictorPool(base, pool_size);
+    }
+    static std::string save_context(BitPredictor& p) {
+      char* buf;
+      size_t n;
+      FILE* f = open_memstream(&buf, &n);
+      if (!f) quit("open_memstream failed");
+      p.save_context(f);
+      fclose(f);
+      std::string s(buf, n);
+      free(buf);
+      return s;
+    }
+    
+    void end(int k) {
+      if (files[k]) fclose(files[k]);
+      files[k] = NULL;
+      if (pool && models[k]) pool->release(models[k]);
+      else delete models[k];
+      models[k] = NULL;
+      contexts[k].clear();
+      if (owner == k) owner = -1;
+      if (channel == k) channel = -1;
+    }
+    
+    // Code the channel of a compressed chunk: k, or the one decompressed
+    int code_channel(Encoder& e, int k) {
+      channel = e.symbol(k, 8, &channelp[(channel+1)*CHANNELS]);
+      return channel;
+    }
+};
+
+// --mux: compress the inputs of mux to out as they come, each read a
+// chunk of its channel
+void do_mux(Mux& mux, FILE* out, int level, BitPredictor& predictor) {
+    if (level<0 || level>=BitPredictor::levels()) quit("Bad model level");
+    fprintf(out, "pQM%c", warm_memopt(predictor));
+    put_control(out, 'L', '0'+level);
+    put_control(out, 'M', mux.shared ? 'S' : 'O');
+    fflush(out);
+    
+    bool warm = false;
+    std::vector<struct pollfd> fds;
+    for (size_t k=0; k<mux.fds.size(); ++k) {
+      struct pollfd p = { mux.fds[k], POLLIN, 0 };
+      fds.push_back(p);
+    }
+    
+    for (size_t open = fds.size(); open; ) {
+      if (poll(fds.data(), fds.size(), -1) < 0) {
+        if (errno == EINTR) continue;
+        quit("poll failed");
+      }
+      // A chunk from each input that has one, so that none starves
+      for (int k=0; k<(int)fds.size(); ++k) {
+        if (fds[k].fd < 0 || !(fds[k].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+        int ret = read(fds[k].fd, &buffer, sizeof buffer);
+        if (ret==-1 && errno==EINTR) continue;
+        if (ret==0 || ret==-1) {
+          put_control(out, 'E', k);
+          fflush(out);
+          mux.end(k);
+          fds[k].fd = -1;  // poll() skips it
+          --open;
+          continue;
+        }
+        
+        // Plain only for the channel of the last chunk, the others have
+        // to say which channel they are of
+        if (mux.channel == k && plain_chunk(buffer, ret)) {
+          fwrite(buffer, ret, 1, out);
+          fflush(out);
+          continue;
+        }
+        
+        if (!warm) {
+          fflush(out);
+          warmup.wait();
+          predictor.set_level(level);
+          warm = true;
+        }
+        put_length(out, ret);
+        Encoder e(COMPRESS, out, predictor);
+        mux.code_channel(e, k);
+        e.use(mux.model(k, predictor));
+        e.compress(buffer, ret);
+        e.flush();
+        putc(0xFF, out);
+        putc(0xFF, out);
+        fflush(out);
+      }
+    }
+}
+
+// Keyframes (KEYFRAME=bytes): after every so many bytes of compressed
+// chunks, the encoder goes back to the state it started from (after LOAD
+// or PRELOAD) and writes a 'K' control record followed by the model level,
+// so that a decoder with the same LOAD or PRELOAD can start decoding there
+// (--join).  The first 'K', in the header, marks the state to go back to.
+struct Keyframes {
+    BitPredictor* base;  // the state at a keyframe, NULL before the first
+    
+    Keyframes() : base(NULL) {}
+    ~Keyframes() { delete base; }
+    
+    // At a 'K': take p as the base, or go back to it
+    void key(BitPredictor& p) {
+      if (!base) base = new BitPredictor(p);
+      else p.reset_to(*base);
+    }
+};
+
+// --join: skip input to a keyframe and return its memory option.  Its
+// 'K' record follows the 0xFF 0xFF that ends a compressed chunk, which
+// never occurs inside one; w is what was read already.
+int skip_to_keyframe(FILE* in, U32 w) {
+    for (;;) {
+      int c = getc(in);
+      if (c==EOF) quit("No keyframe in the input");
+      if (w==0xFFFFFEFF && c=='K') return getc(in);
+      w = w<<8|c;
+    }
+}
+
+// grow: largest memory option to grow to, 0 = never grow
+// keyframe: input bytes between keyframes, 0 = none
+// duplex: this is the sending half of --duplex
+void do_compress(FILE* in, FILE* out, int level, double target, unsigned char grow, long long keyframe,
+                 BitPredictor& predictor, Duplex* duplex=NULL) {
+    if (level<0 || level>=BitPredictor::levels()) quit("Bad model level");
+    Governor governor(target, level);
+    Keyframes keys;
+    long long since_key = 0;
+    bool warm = false;
+    auto warm_up = [&]() {
+      if (warm) return;
+      fflush(out);
+      warmup.wait();
+      predictor.set_level(level);
+      if (keyframe) keys.key(predictor);
+      warm = true;
+    };
+    unsigned char mem = warm_memopt(predictor);
+    if (level==0 && !target && !grow && !keyframe && !duplex) {
+      fprintf(out, "pQS%c", mem);
+    } else {
+      fprintf(out, duplex ? "pQD%c" : "pQX%c", mem);
+      put_control(out, 'L', '0'+level);
+    }
+    if (keyframe) put_control(out, 'K', mem);
+    fflush(out);
+
+    for(;;) {
+      if (duplex) {
+        // Input, or chunks that came in: when there are many, prime with
+        // them now, as the other end keeps what it sent until then
+        struct pollfd fds[2] = { { fileno(in), POLLIN, 0 }, { duplex->wake[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+          if (errno == EINTR) continue;
+          quit("poll failed");
+        }
+        if (!(fds[0].revents & (POLLIN|POLLHUP|POLLERR))) {
+          if (duplex->backlog() >= Duplex::BACKLOG) {
+            warm_up();
+            put_acks(out, duplex->prime_received(predictor));
+            fflush(out);
+          }
+          continue;
         }
       }
       
-      if(smallthing) {
+      // With a target or --duplex, read() rather than fread(): take
+      // whatever is available now, so each chunk goes out promptly and a
+      // full buffer means the input is backlogged
+      int ret = target || duplex ? read(fileno(in), &buffer, sizeof buffer)
+                                 : fread(&buffer, 1, sizeof buffer, in);
+      if (ret==-1 && errno==EINTR) continue;
+      if (ret==0 || ret==-1) {
+        break;
+      }
+      
+      if(plain_chunk(buffer, ret)) {
         fwrite(buffer, ret, 1, out);
         fflush(out);
         continue;
-      } else
-      if(ret<64) {
-        unsigned char c = ret | 0x80;
-        putc(c, out);
-      } else {
-        int c = (ret >> 8) | 0xC0;
-        int d = ret & 0xFF;
-        putc(c, out); // maximum 0xFE
-        putc(d, out); // maximum 0xFE
       }
       
+      warm_up();
+      int primed = 0;
+      if (duplex) {
+        primed = duplex->prime_received(predictor);
+        duplex->sending(buffer, ret);
+      }
+      
+      put_length(out, ret);
+      
+      double chunk_start = target ? Governor::seconds() : 0;
       Encoder e(COMPRESS, out, predictor);
+      if (duplex) e.count(primed, &duplex->ackp_out);
       
-      int i;
-      for (i=0; i<ret; ++i) {
-        e.compress(buffer[i]);
-      }
+      e.compress(buffer, ret);
       e.flush();
       putc(0xFF, out);
       putc(0xFF, out);
-      fflush(out);
       
+      int l = predictor.level();
+      if (target) {
+        double seconds = Governor::seconds()-chunk_start;
+        l = governor.next(l, ret, seconds, ret==sizeof buffer);
+      }
+      // A 'K' has to come right after the 0xFF 0xFF for --join to find
+      // it, so a new level from the governor goes in the 'L' after it
+      since_key += ret;
+      if (keyframe && since_key >= keyframe) {
+        keys.key(predictor);
+        predictor.set_level(l);
+        put_control(out, 'K', mem);
+        put_control(out, 'L', '0'+l);
+        since_key = 0;
+      } else if (l != predictor.level()) {
+        predictor.set_level(l);
+        put_control(out, 'L', '0'+l);
+      }
+      if (mem < grow && predictor.full() && predictor.grow()) {
+        put_control(out, 'G', ++mem);
+      }
+      fflush(out);
+      predictor.sync();
+      checkpointer.poll(predictor);
     }
 }
 
-void do_decompress(FILE* in, FILE* out, BitPredictor& predictor) {
+// duplex: this is the receiving half of --duplex
+// mux: outputs of --demux, out is not used then
+// join: the input may start anywhere, decode from its first keyframe
+void do_decompress(FILE* in, FILE* out, BitPredictor& predictor, Duplex* duplex=NULL, Mux* mux=NULL, bool join=false) {
+    Keyframes keys;
+    bool warm = false;
     // Check header version, get memory option, file size
-    if (getc(in)!='p' || getc(in)!='Q' || getc(in)!='S')
+    int c1 = getc(in), c2 = c1=='p' ? getc(in) : EOF;
+    bool joined = join && !(c1=='p' && c2=='Q');
+    if (joined) {
+      int m = skip_to_keyframe(in, c1=='p' ? 'p'<<8|(c2&0xFF) : c1&0xFF);
+      warmup.wait();
+      if (m != memopt(predictor)) quit("Keyframe of another memory option");
+      predictor.set_level(0);
+      warm = true;
+      keys.key(predictor);
+    } else
+    if (c1!='p' || c2!='Q')
+      quit("Not a lpaq1_stream file");
+    int format = joined ? 'X' : getc(in);
+    if (format=='D' && !duplex)
+      quit("This is one direction of a --duplex connection");
+    if (format=='M' && !mux)
+      quit("This is a multiplexed stream, use --demux");
+    if (format!='S' && format!='X' && !(format=='D' && duplex) && !(format=='M' && mux))
       quit("Not a lpaq1_stream file");
+    if (mux && format!='M')
+      quit("Not a multiplexed stream");
     
-    {
+    if (!joined) {
       int m = getc(in);
       if (m<'0' || m>'9') quit("Bad memory option (not 0..9)");
-      int MEM2 = getmem(m);
-      assert(MEM2 == predictor.MEM());
+      assert(m == warm_memopt(predictor));
     }
+    BitPredictor* p = &predictor;  // the model of the current channel
+    if (mux) out = NULL;  // until the first channel
 
     for (;;) {
       int c = getc(in);
@@ -411,58 +1105,86 @@ void do_decompress(FILE* in, FILE* out, BitPredictor& predictor) {
       int len;
       if(c==0xFF) continue;
       if (c<0x80) {
+        if (mux && mux->channel<0) quit("Bad multiplexed stream");
         if(out) {
           putc(c, out);
           fflush(out);
         }
         continue;
       }
+      if (!warm) {
+        warmup.wait();
+        predictor.set_level(0);
+        warm = true;
+      }
       if (c<0xC0) {
         len = c&0x3F;
       } else {
         int d = getc(in);
+        if (c==0xFE && d==0xFF) {
+          int op = getc(in);
+          int arg = getc(in);
+          if (op=='L' && arg>='0' && arg<'0'+BitPredictor::levels()) {
+            p->set_level(arg-'0');
+          } else
+          if (op=='G' && arg>'0' && arg<='9' && getmem(arg) == p->MEM()*2) {
+            p->grow();
+          } else
+          if (op=='A' && format=='D' && arg>0) {
+            duplex->acked(predictor, arg);
+          } else
+          if (op=='K' && !mux && arg==memopt(predictor)) {
+            keys.key(predictor);
+          } else
+          if (op=='M' && format=='M' && !mux->started && (arg=='S' || arg=='O')) {
+            mux->shared = arg=='S';
+          } else
+          if (op=='E' && format=='M' && arg<(int)mux->files.size()) {
+            if (mux->channel == arg) {
+              out = NULL;
+              p = &predictor;
+            }
+            mux->end(arg);
+          } else {
+            quit("Bad control record");
+          }
+          continue;
+        }
         len = ((c&0x3F) << 8) | d;
       }
       
-      Encoder e(DECOMPRESS, in, predictor);
-      int i;
-      for(i=0; i<len; ++i) {
-        unsigned char c = e.decompress();
-        if (out) {
-          putc(c, out);
-        }
+      Encoder e(DECOMPRESS, in, *p);
+      if (mux) {
+        int k = mux->code_channel(e, 0);
+        if (k >= (int)mux->files.size()) quit("More channels than --demux outputs");
+        if (!mux->files[k]) quit("Chunk for a channel that has ended");
+        out = mux->files[k];
+        p = &mux->model(k, predictor);
+        e.use(*p);
       }
+      if (duplex) duplex->acked(predictor, e.count(0, &duplex->ackp_in));
+      unsigned char chunk[0x4000];
+      e.decompress(chunk, len);
+      if (out) fwrite(chunk, 1, len, out);
+      if (duplex) duplex->got(chunk, len);
       if (out) {
         fflush(out);
+        predictor.sync();
+        checkpointer.poll(predictor);
       }
     }
 }
 
 
-int measure_entropy(const char* buf, int l, BitPredictor& p) {
-  int s = 0;
-  
-  for (int j=0; j<l; ++j) {
-    for (int i=7; i>=0; --i) {
-      int bit = (buf[j]>>i)&1;
-      int prediction = p.p();
-      
-      if (bit) {
-         s += 4096-prediction;
-      } else {
-         s += prediction;
-      }
-    
-      p.update(bit);
-    }
-  }
-  return s;
-}
+// Lines sharing at least MINSHARE bytes with others of a batch have them
+// scored once by the p and c modes, see prefix_batch.h
+enum { MINSHARE = 16 };
 
 void do_analyse(FILE* in, FILE* out, const char* modes, BitPredictor& predictor, int filter_mode, int MEM) {
   struct {
     BitPredictor* template_;
     BitPredictor* active;
+    BitPredictor* prefix;  // checkpoint after a shared prefix, p and c
     int s;
     char mode;
     bool needs_reset;
@@ -493,7 +1215,8 @@ void do_analyse(FILE* in, FILE* out, const char* modes, BitPredictor& predictor,
     switch (in.mode) {
       case 'p':
       case 'c':
-        in.active = new BitPredictor(MEM);
+        in.active = new BitPredictor(*in.template_);  // for reset_to()
+        in.prefix = new BitPredictor(*in.template_);
         in.needs_reset = true;
         break;
       case 'P':
@@ -504,41 +1227,173 @@ void do_analyse(FILE* in, FILE* out, const char* modes, BitPredictor& predictor,
     }
   }
   
+  // p and c modes score every line from the same state, so the lines of
+  // a batch can go in any order; P and C modes go on from line to line
+  BitPredictor* resets[16];
+  BitPredictor* templates[16];
+  BitPredictor* prefixes[16];
+  int reset_mode[16];
+  int nresets = 0;
+  BitPredictor* runs[16];
+  int run_mode[16];
+  int nruns = 0;
+  long long scores[16];
+  long long pre[16];
+  ITERATE_MODES {
+    auto & in = info[i];
+    if (in.needs_reset) {
+      templates[nresets] = in.template_;
+      prefixes[nresets] = in.prefix;
+      reset_mode[nresets] = i;
+      resets[nresets++] = in.active;
+    } else {
+      run_mode[nruns] = i;
+      runs[nruns++] = in.active;
+    }
+  }
+  
   bool negative_filter = false;
   if (filter_mode < 0) { filter_mode = -filter_mode; negative_filter = true; }
   
-  while(!feof(in)) { 
-    char line[65536]; 
-    if(!fgets(line, sizeof line-1, in)) break; 
-    line[65535]=0; 
-    int l = strlen(line);
+  // BATCH lines are read at once and grouped by common prefixes.  Output
+  // stays in input order, but comes a batch at a time.
+  int batch = getenv("BATCH") ? atoi(getenv("BATCH")) : 1;
+  if (batch < 1) batch = 1;
+  if (batch > 1<<16) batch = 1<<16;
+  std::vector<const char*> lines(batch);
+  std::vector<size_t> sizes(batch);
+  std::vector<int> lens(batch), order(batch), gstart(batch+1), glen(batch);
+  long long (*linescores)[16] = new long long[batch][16];
+  std::vector<bool> keep(batch);
+  
+  // SCORE_CACHE keeps what the p and c modes (or the filter) gave for that
+  // many recent lines, for identical lines to reuse
+  struct LineResult {
+    long long s[16];  // per p or c mode
+    bool keep;
+  };
+  long cache_size = getenv("SCORE_CACHE") ? atol(getenv("SCORE_CACHE")) : 0;
+  ScoreCache<LineResult> cache(cache_size > 0 ? cache_size : 0);
+  
+  // RECORDS=nul or length reads NUL terminated or length prefixed records
+  // instead of lines, and writes them back the same way
+  int format = RecordReader::format(getenv("RECORDS") ? getenv("RECORDS") : "newline");
+  if (format < 0) quit("RECORDS must be newline, nul or length");
+  
+  if (resume.active()) resume.start(in, modes, runs, nruns);
+  
+  // A line still being written is left for the next run or poll
+  RecordReader* reader = new RecordReader(fileno(in), RecordReader::Format(format), resume.active(), resume.offset);
+  
+  for (;;) { 
+    int n = reader->read(lines.data(), sizes.data(), batch);
+    bool at_end = n < batch;
+    for (int j=0; j<n; ++j) {
+      if (sizes[j] > INT_MAX) quit("Record too long");
+      lens[j] = sizes[j];
+    }
     
-    ITERATE_MODES {
-      auto & in = info[i];
-      
-      if (in.needs_reset) {
-        *in.active = *in.template_;
-      }      
-      
-      in.s = measure_entropy(line, l, *in.active);   
+    for (int j=0; j<n; ++j) {
+      BitPredictor::cost_many(runs, nruns, lines[j], lens[j], scores);
+      for (int k=0; k<nruns; ++k) linescores[j][run_mode[k]] = scores[k];
+    }
+    
+    int groups = prefix_groups(lines.data(), lens.data(), n, MINSHARE, order.data(), gstart.data(), glen.data());
+    for (int g=0; g<groups; ++g) {
+      int shared = glen[g];
+      bool have_prefix = false;
+      for (int k=0; k<nresets; ++k) pre[k] = 0;
       
-      if (filter_mode == 0) {
-        fprintf(out, "%d ", in.s);
+      for (int o=gstart[g]; o<gstart[g+1]; ++o) {
+        int j = order[o];
+        const char* rest = lines[j] + shared;
+        int l = lens[j] - shared;
+        LineResult r = {};
+        
+        if (cache.get(lines[j], lens[j], r)) {
+          for (int k=0; k<nresets; ++k) linescores[j][reset_mode[k]] = r.s[k];
+          keep[j] = r.keep;
+          continue;
+        }
+        
+        if (shared && !have_prefix) {
+          for (int k=0; k<nresets; ++k) prefixes[k]->reset_to(*templates[k]);
+          BitPredictor::cost_many(prefixes, nresets, lines[j], shared, pre);
+          have_prefix = true;
+        }
+        
+        for (int k=0; k<nresets; ++k) {
+          if (shared) resets[k]->reset_to(*templates[k], *prefixes[k]);
+          else resets[k]->reset_to(*templates[k]);
+        }
+        
+        if (filter_mode == 0) {
+          BitPredictor::cost_many(resets, nresets, rest, l, scores);
+          for (int k=0; k<nresets; ++k) r.s[k] = linescores[j][reset_mode[k]] = pre[k] + scores[k];
+        } else {
+          // The line is out as soon as the fresh model costs more than the
+          // threshold, no need to score it to the end
+          long long s0 = pre[0] + resets[0]->cost(rest, l);
+          long long bound = filter_mode * s0 / 1000;
+          long long s1 = pre[1] + resets[1]->cost(rest, l, bound - pre[1]);
+          keep[j] = s1 <= bound;
+          if (negative_filter) keep[j] = ! keep[j];
+        }
+        r.keep = keep[j];
+        cache.put(lines[j], lens[j], r);
       }
     }
     
-    bool do_output = true;
-    
-    if (filter_mode != 0) {
-      if (info[1].s  > ((unsigned long long)filter_mode) * info[0].s / 1000) do_output = false;
-      if (negative_filter) do_output = ! do_output;
+    for (int j=0; j<n; ++j) {
+      bool do_output = true;
+      char head[16*21];
+      int hl = 0;
+      
+      if (filter_mode == 0) {
+        ITERATE_MODES {
+          hl += sprintf(head + hl, "%lld ", linescores[j][i]);
+        }
+      } else {
+        do_output = keep[j];
+      }
+      
+      if (do_output) {
+        RecordReader::put(out, RecordReader::Format(format), head, hl, lines[j], lens[j]);
+        fflush(out);
+      }
     }
+    resume.offset = reader->offset();
     
-    if (do_output) {
-      fwrite(line, 1, l, out);
-      fflush(out);
+    if (at_end || interrupted) {
+      resume.save(in, modes, runs, nruns);
+      if (!resume.wait(in)) break;
+      // Read what has been added since
+      delete reader;
+      reader = new RecordReader(fileno(in), RecordReader::Format(format), true, resume.offset);
     }
   }
+  delete reader;
+  
+  if (cache_size > 0)
+    fprintf(stderr, "score cache: %ld hits, %ld misses\n", cache.hits, cache.misses);
+}
+
+// --duplex=fd: in goes to the socket fd compressed, and what comes from
+// it decompressed to out, see Duplex.  The other end runs the same with
+// the same N and LOAD or PRELOAD.
+void do_duplex(int fd, FILE* in, FILE* out, int level, double target, unsigned char grow, BitPredictor& predictor) {
+  warmup.wait();
+  BitPredictor incoming(predictor);
+  Duplex duplex;
+  FILE* to = fdopen(fd, "wb");
+  FILE* from = fdopen(dup(fd), "rb");
+  if (!to || !from) quit("Bad --duplex file descriptor");
+  
+  std::thread receiver([&]() { do_decompress(from, out, incoming, &duplex); });
+  do_compress(in, to, level, target, grow, 0, predictor, &duplex);
+  fflush(to);
+  if (shutdown(fd, SHUT_WR)) fclose(to);  // not a socket, just close it
+  receiver.join();
 }
 
 void do_fantasy(FILE* in, FILE* out, BitPredictor& predictor, int length, int MEM)
@@ -556,13 +1411,7 @@ void do_fantasy(FILE* in, FILE* out, BitPredictor& predictor, int length, int ME
     line[l]=0; // trim '\n'
     
     p = predictor;
-    
-    for (int j=0; j<l; ++j) {
-      for (int i=7; i>=0; --i) {
-        int bit = (line[j]>>i)&1;      
-        p.update(bit);
-      }
-    }
+    p.update_bytes(line, l);
     
     fwrite(line, 1, l, out);
     
@@ -604,17 +1453,44 @@ int main(int argc, char **argv) {
       "\n"
       "To compress:      lpaq1_stream N -c < file > file.lps  (N=0..9, uses 3+3*2^N MB)\n"
       "To decompress:    lpaq1_stream N -d < file.lps > file  (needs same memory)\n"
+      "To decompress from the middle: tail -c +OFFSET file.lps | lpaq1_stream N --join\n"
+      "                      (from the first keyframe on, see KEYFRAME)\n"
       "To analyse lines: lpaq1_stream N --analyse=[pPcC] < file.txt > file.txt\n"
       "                      p - prefeeded (see PRELOAD or LOAD); c - clean; P/C - accumulated\n"
       "To filter lines:  lpaq1_stream N --filter=5000 < file.txt > file.txt\n"
       "                      (useless without PRELOAD or LOAD, argument is per millis, negative for inclusive filtering)\n"
       "To 'guess' continuations of lines: lpaq1_stream N --fantasy=length < file.txt > file.txt\n"
       "                      (useless without PRELOAD or LOAD)\n"
+      "For both directions of a connection over socket fd: lpaq1_stream N --duplex=fd\n"
+      "                      (stdin goes out compressed, stdout gets what comes in; the\n"
+      "                      directions share what they have seen, both ends need the same N)\n"
+      "To multiplex:     lpaq1_stream N --mux=3,4,5 3<a.log 4<b.log 5<c.log > all.lps\n"
+      "To demultiplex:   lpaq1_stream N --demux=3,4,5 < all.lps 3>a.log 4>b.log 5>c.log\n"
+      "                      (a channel each, with a context of its own in a shared model,\n"
+      "                      or with a model of its own when MUX_MODEL=own; POOL=n[:MB]\n"
+      "                      keeps n such models, up to MB, ready for new channels)\n"
       "\n"
       "Each read produces a compressed chunk, \"lpaq1_stream 3 -c | lpaq1_stream 3 -d\" should print your input immediately. \n"
       "\n"
       "Set PRELOAD to initialize predictor with the specified lpaq1_stream-compressed file.\n"
-      "Set LOAD to load predictor state before working, SAVE to save it after working.\n");
+      "Set LOAD to load predictor state before working, SAVE to save it after working.\n"
+      "    SAVE_FORMAT=compact writes a much smaller state file; LOAD reads either format.\n"
+      "Set SAVE_DELTA to save only what changed since LOAD (much faster and smaller);\n"
+      "    LOAD=state:delta1:delta2... loads a state and applies deltas in order.\n"
+      "Set PERSIST to keep the state in a memory mapped file: learning is kept there as\n"
+      "    it happens, and the next run with the same PERSIST starts from it instantly.\n"
+      "Set CHECKPOINT to also save the state there every CHECKPOINT_INTERVAL seconds\n"
+      "    (default 60) between chunks, from a forked copy without pausing the stream.\n"
+      "Set GROW=M to start with memory option N and double it, up to M, whenever the\n"
+      "    model fills up (decompress with the same N, it follows).\n"
+      "Set KEYFRAME to a number of bytes to go back to the initial (LOAD or PRELOAD) state\n"
+      "    after that much input each time, so that --join can start decoding there.\n"
+      "Set LEVEL=0..3 to compress faster with fewer models (0 is the default, best ratio).\n"
+      "Set TARGET_MBPS and/or TARGET_LATENCY (milliseconds per chunk) to switch to faster\n"
+      "    levels per chunk whenever input backs up and compression falls behind the target.\n"
+      "Set RESUME for --analyse or --filter over a growing file (on stdin) to go on where the\n"
+      "    last run with the same RESUME file stopped, keeping the P and C models.\n"
+      "    Set FOLLOW to a number of seconds for them to wait for more lines, like tail -f.\n");
     return 1;
   }
 
@@ -629,36 +1505,153 @@ int main(int argc, char **argv) {
 
   BitPredictor predictor(MEM);
   
-  if (getenv("LOAD")) { FILE* f = fopen(getenv("LOAD"), "rb"); predictor.load(f); }
+  // a forked checkpoint would share the mapped tables, still being written
+  if (getenv("PERSIST") && getenv("CHECKPOINT")) quit("CHECKPOINT can't be used with PERSIST");
+  if (getenv("PERSIST")) predictor.persist(getenv("PERSIST"));
+  if (getenv("SAVE_DELTA")) predictor.track_changes();
   
+  // Only a PRELOAD stream with control records ("pQX") can hold the G
+  // records that grow the predictor; "pQS" leaves its memory option as is
+  FILE* preload = NULL;
+  bool grows = false;
   if (getenv("PRELOAD")) {
-    FILE* preload = fopen(getenv("PRELOAD"), "rb");
-    if(!preload) quit("Can't open PRELOAD file");
-    do_decompress(preload, NULL, predictor);
+    preload = fopen(getenv("PRELOAD"), "rb");
+    if (!preload) quit("Can't open PRELOAD file");
+    char h[3];
+    grows = fread(h, 1, 3, preload) < 3 || memcmp(h, "pQS", 3);
+    rewind(preload);
+  }
+  
+  if (getenv("LOAD") || preload) warmup.start([&]() {
+    if (getenv("LOAD")) {
+      // state[:delta...]
+      char* names = strdup(getenv("LOAD"));
+      bool delta = false;
+      for (char* name = strtok(names, ":"); name; name = strtok(NULL, ":")) {
+        FILE* f = fopen(name, "rb");
+        if (!f) { fprintf(stderr, "%s: ", name); quit("Can't open LOAD file"); }
+        if (delta) predictor.load_delta(f);
+        else predictor.load(f);
+        fclose(f);
+        delta = true;
+      }
+      free(names);
+    }
+    
+    if (preload) do_decompress(preload, NULL, predictor);
+  }, memopt(predictor), grows);
+  
+  if (getenv("CHECKPOINT")) {
+    checkpointer.path = getenv("CHECKPOINT");
+    checkpointer.compact = getenv("SAVE_FORMAT") && !strcmp(getenv("SAVE_FORMAT"), "compact");
+    if (getenv("CHECKPOINT_INTERVAL")) checkpointer.interval = atof(getenv("CHECKPOINT_INTERVAL"));
   }
   
+  resume.path = getenv("RESUME");
+  resume.compact = getenv("SAVE_FORMAT") && !strcmp(getenv("SAVE_FORMAT"), "compact");
+  if (getenv("FOLLOW")) resume.follow = atof(getenv("FOLLOW"));
+  if (resume.follow < 0) quit("FOLLOW must be a number of seconds");
+  
   // Compress
-  if (!strcmp(argv[2], "-c")) {
-      do_compress(in, out, argv[1][0], predictor);
+  bool duplex = !strncmp(argv[2], "--duplex=", strlen("--duplex="));
+  if (!strcmp(argv[2], "-c") || duplex) {
+      int level = getenv("LEVEL") ? atoi(getenv("LEVEL")) : 0;
+      double target = 0;  // seconds per byte
+      if (getenv("TARGET_MBPS")) {
+        double mbps = env_number("TARGET_MBPS");
+        if (mbps <= 0) quit("TARGET_MBPS must be a positive number");
+        target = 1.0/(mbps*1048576);
+      }
+      if (getenv("TARGET_LATENCY")) {
+        double ms = env_number("TARGET_LATENCY");
+        if (ms <= 0) quit("TARGET_LATENCY must be a positive number of milliseconds");
+        double t = ms/1000/sizeof buffer;
+        if (!target || t < target) target = t;
+      }
+      unsigned char grow = 0;
+      if (getenv("GROW")) {
+        grow = getenv("GROW")[0];
+        if (grow<'0' || grow>'9') quit("GROW must be a memory option 0..9");
+        if (getenv("PERSIST") || getenv("SAVE_DELTA")) quit("GROW can't be used with PERSIST or SAVE_DELTA");
+      }
+      long long keyframe = getenv("KEYFRAME") ? atoll(getenv("KEYFRAME")) : 0;
+      if (keyframe < 0) quit("KEYFRAME must be a number of bytes");
+      if (keyframe && (grow || getenv("PERSIST") || getenv("SAVE_DELTA")))
+        quit("KEYFRAME can't be used with GROW, PERSIST or SAVE_DELTA");
+      if (duplex) {
+        if (getenv("PERSIST") || getenv("CHECKPOINT") || keyframe) quit("--duplex can't be used with PERSIST, CHECKPOINT or KEYFRAME");
+        do_duplex(atoi(argv[2] + strlen("--duplex=")), in, out, level, target, grow, predictor);
+      } else {
+        do_compress(in, out, level, target, grow, keyframe, predictor);
+      }
   } else
   if (!strncmp(argv[2], "--analyse=", strlen("--analyse="))) {
       const char* modes = argv[2] + strlen("--analyse=");
+      warmup.wait();
       do_analyse(in, out, modes, predictor, 0, MEM);
   } else
   if (!strncmp(argv[2], "--filter=", strlen("--filter="))) {
+      warmup.wait();
       do_analyse(in, out, "pc", predictor, atoi(argv[2] + strlen("--filter=")), MEM);
   } else
   if (!strncmp(argv[2], "--fantasy=", strlen("--fantasy="))) {
+      warmup.wait();
       do_fantasy(in, out, predictor, atoi(argv[2]+strlen("--fantasy=")), MEM);
   } else
   if (!strcmp(argv[2], "-d")) {
     do_decompress(in, out, predictor);
+  } else
+  if (!strcmp(argv[2], "--join")) {
+    do_decompress(in, out, predictor, NULL, NULL, true);
+  } else
+  if (!strncmp(argv[2], "--mux=", strlen("--mux=")) || !strncmp(argv[2], "--demux=", strlen("--demux="))) {
+    const char* excluded[] = { "PERSIST", "CHECKPOINT", "GROW", "TARGET_MBPS", "TARGET_LATENCY", "KEYFRAME", "SAVE", "SAVE_DELTA" };
+    for (size_t i=0; i<sizeof excluded/sizeof *excluded; ++i) {
+      if (getenv(excluded[i])) { fprintf(stderr, "%s: ", excluded[i]); quit("can't be used with --mux or --demux"); }
+    }
+    int pool_size = 0, pool_mb = 0;
+    if (getenv("POOL") && (sscanf(getenv("POOL"), "%d:%d", &pool_size, &pool_mb) < 1 || pool_size < 1 || pool_mb < 0))
+      quit("POOL must be n or n:MB");
+    if (argv[2][2]=='m') {
+      Mux mux(argv[2] + strlen("--mux="), false);
+      mux.pool_size = pool_size;
+      mux.pool_bytes = (size_t)pool_mb << 20;
+      const char* model = getenv("MUX_MODEL");
+      if (model && strcmp(model, "shared") && strcmp(model, "own")) quit("MUX_MODEL must be shared or own");
+      mux.shared = !model || !strcmp(model, "shared");
+      do_mux(mux, out, getenv("LEVEL") ? atoi(getenv("LEVEL")) : 0, predictor);
+    } else {
+      Mux mux(argv[2] + strlen("--demux="), true);
+      mux.pool_size = pool_size;
+      mux.pool_bytes = (size_t)pool_mb << 20;
+      do_decompress(in, NULL, predictor, NULL, &mux);
+    }
   } else {
     fprintf(stderr, "Unknown mode %s\n", argv[2]);
-    return 1;  
+    _Exit(1);  // without waiting for LOAD
   }
   
-  if (getenv("SAVE")) { FILE* f = fopen(getenv("SAVE"), "wb"); predictor.save(f); }
+  warmup.wait();
+  checkpointer.reap(true);
+  
+  // Before SAVE, so that the delta is against LOAD and both files end
+  // up with the same state id
+  if (getenv("SAVE_DELTA")) {
+    FILE* f = fopen(getenv("SAVE_DELTA"), "wb");
+    if (!f) quit("Can't open SAVE_DELTA file");
+    predictor.save_delta(f);
+    fclose(f);
+  }
+  
+  if (getenv("SAVE")) {
+    FILE* f = fopen(getenv("SAVE"), "wb");
+    if (!f) quit("Can't open SAVE file");
+    const char* format = getenv("SAVE_FORMAT");
+    if (format && !strcmp(format, "compact")) predictor.save_compact(f);
+    else if (!format || !strcmp(format, "raw")) predictor.save(f);
+    else quit("SAVE_FORMAT must be raw or compact");
+    fclose(f);
+  }
 
   return 0;
 }
@@ -0,0 +1,120 @@
+#pragma once
+
+// A pool of ready predictors for code that starts many short-lived models
+// (a class, a stream or a connection each): acquire() hands out one equal
+// to the template in O(1) when one is ready, and release() gives it back
+// to a background thread, which copies the template over it again.  The
+// copy also touches every page, so an acquired predictor doesn't fault
+// its tables in during its first updates as a new one does.
+//
+// PredictorPool pool(tmpl, size, max_bytes) keeps up to size predictors
+// ready, made in the background; tmpl has to outlive the pool.  With
+// max_bytes, no more predictors than fit in it exist at once (ready, in
+// use and being reset), see footprint(); acquire() waits for a released
+// one then.  0 means no cap.
+// pool.acquire() returns a predictor equal to tmpl, new if none is ready.
+// pool.release(p) hands p back; p must have the template's MEM (not have
+//     grown) and not be persist()ent.  Beyond size ready ones it is freed.
+// Predictors still out when the pool is destroyed are the caller's.
+
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "bit_predictor.h"
+
+class PredictorPool {
+    const BitPredictor& tmpl;
+    size_t size;                // ready predictors to keep
+    size_t cap;                 // predictors that may exist, 0 = any number
+    size_t alive;               // that exist now
+    size_t busy;                // being reset or made
+    std::vector<BitPredictor*> ready;
+    std::deque<BitPredictor*> dirty;  // released, to reset
+    bool stopping;
+    std::mutex lock;
+    std::condition_variable work, done;
+    std::thread worker;
+
+    // Reset released predictors and top up the ready ones
+    void run() {
+        std::unique_lock<std::mutex> l(lock);
+        for (;;) {
+            work.wait(l, [&] { return stopping || !dirty.empty() || wants_new(); });
+            if (stopping) return;
+            BitPredictor* p = NULL;
+            if (!dirty.empty()) {
+                p = dirty.front();
+                dirty.pop_front();
+            } else {
+                ++alive;
+            }
+            ++busy;
+            l.unlock();
+            if (p) *p = tmpl;
+            else p = new BitPredictor(tmpl);
+            l.lock();
+            --busy;
+            ready.push_back(p);
+            done.notify_all();
+        }
+    }
+
+    bool wants_new() const {
+        return ready.size() + dirty.size() + busy < size && (!cap || alive < cap);
+    }
+
+public:
+    // Bytes of one predictor of memory size MEM, as in the lpaq1_stream
+    // usage: 3 MB and 3 times MEM
+    static size_t footprint(int MEM) { return 3*(size_t)MEM + (3 << 20); }
+
+    PredictorPool(const BitPredictor& tmpl, size_t size, size_t max_bytes = 0)
+        : tmpl(tmpl), size(size), cap(max_bytes ? max_bytes / footprint(tmpl.MEM()) : 0),
+          alive(0), busy(0), stopping(false) {
+        if (max_bytes && cap < 1) cap = 1;
+        worker = std::thread(&PredictorPool::run, this);
+    }
+
+    ~PredictorPool() {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            stopping = true;
+        }
+        work.notify_one();
+        worker.join();
+        for (BitPredictor* p : ready) delete p;
+        for (BitPredictor* p : dirty) delete p;
+    }
+
+    BitPredictor* acquire() {
+        std::unique_lock<std::mutex> l(lock);
+        done.wait(l, [&] { return !ready.empty() || !cap || alive < cap; });
+        work.notify_one();  // to top up
+        if (!ready.empty()) {
+            BitPredictor* p = ready.back();
+            ready.pop_back();
+            return p;
+        }
+        ++alive;
+        l.unlock();
+        return new BitPredictor(tmpl);
+    }
+
+    void release(BitPredictor* p) {
+        std::unique_lock<std::mutex> l(lock);
+        if (ready.size() + dirty.size() + busy < size) {
+            dirty.push_back(p);
+            work.notify_one();
+            return;
+        }
+        --alive;
+        l.unlock();
+        delete p;
+        done.notify_all();  // room for a new one
+        work.notify_one();
+    }
+};
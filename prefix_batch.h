@@ -0,0 +1,48 @@
+#pragma once
+
+// Groups the lines of a batch by shared prefixes, so that a tool scoring
+// each line from the same state can score a group's prefix once, keep
+// the predictor there as a checkpoint (BitPredictor::reset_to(p, c)) and
+// go on from it with each line's suffix.
+//
+// prefix_groups(lines, lens, n, minshare, order, gstart, glen) sorts the
+// n lines into order[] and splits that into groups of consecutive lines:
+// group g is order[gstart[g]..gstart[g+1]) and all its lines start with
+// the same glen[g] bytes, at least minshare, or glen[g] is 0 for a line
+// with no such neighbour.  gstart[] needs n+1 entries.  Returns the
+// number of groups.  Groups are grown greedily in sorted order, so a
+// group's prefix is what all of its lines share.
+
+#include <string.h>
+#include <algorithm>
+
+inline int common_prefix(const char* a, int la, const char* b, int lb) {
+    int n = la < lb ? la : lb, i = 0;
+    while (i < n && a[i] == b[i]) ++i;
+    return i;
+}
+
+inline int prefix_groups(const char* const* lines, const int* lens, int n, int minshare,
+                         int* order, int* gstart, int* glen) {
+    for (int i = 0; i < n; ++i) order[i] = i;
+    std::sort(order, order + n, [&](int a, int b) {
+        int c = memcmp(lines[a], lines[b], lens[a] < lens[b] ? lens[a] : lens[b]);
+        return c ? c < 0 : lens[a] < lens[b] || (lens[a] == lens[b] && a < b);
+    });
+
+    int groups = 0;
+    for (int k = 0; k < n; ) {
+        int share = lens[order[k]], e = k + 1;
+        for (; e < n; ++e) {
+            int c = common_prefix(lines[order[e-1]], lens[order[e-1]], lines[order[e]], lens[order[e]]);
+            if (c < minshare) break;
+            if (c < share) share = c;
+        }
+        gstart[groups] = k;
+        glen[groups] = e - k > 1 ? share : 0;
+        ++groups;
+        k = e;
+    }
+    gstart[groups] = n;
+    return groups;
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+// Reads input records as views into memory, without copying each one: a
+// regular file is memory mapped whole, anything else (a pipe) is read in
+// large blocks into a buffer that grows to hold the longest record.  A
+// record is
+//   NEWLINE  the bytes up to and including a '\n' (the default),
+//   NUL      the bytes up to and including a '\0',
+//   LENGTH   a 4-byte big-endian length, then that many bytes: the record.
+// A last record without its delimiter (or shorter than its length) comes
+// as it is, unless complete_only is set: then it is left for a later
+// reader, e.g. because the file is still being written.  Such a file is
+// read from the offset into the buffer instead of mapped, as reading
+// a mapping past a truncation would raise SIGBUS, and a later reader
+// then reads only what it has not seen.
+//
+// RecordReader r(fd, format, complete_only, offset) reads fd from that
+// byte offset, which only a regular file can start at.
+// r.read(recs, lens, n) sets up to n records and returns how many; they
+//     stay valid until the next read() and 0 means the end of input.
+// r.offset() is the input offset after the records read so far.
+// RecordReader::put(f, format, head, hl, rec, l) writes a record of hl
+//     bytes of head followed by l of rec to f, in that format.
+// RecordReader::format(name) is the format for "newline", "nul" or
+//     "length", -1 for anything else.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+class RecordReader {
+public:
+    enum Format { NEWLINE, NUL, LENGTH };
+
+private:
+    int fd;
+    Format fmt;
+    bool complete_only;
+    const char* map;     // the whole file if mapped, else NULL
+    size_t size;         // of the map
+    char* buf;           // not mapped: buf[start..end) is read but not returned
+    size_t cap, start, end;
+    bool eof;
+    size_t pos;          // input offset after the records returned
+    std::vector<size_t> offs;  // records of the last read() in buf
+
+    // Length of the record at p[0..n), 0 if incomplete; *skip is set to
+    // the bytes of framing in front of it
+    size_t record(const char* p, size_t n, size_t* skip) const {
+        *skip = 0;
+        if (fmt == LENGTH) {
+            if (n < 4) return 0;
+            const unsigned char* u = (const unsigned char*)p;
+            size_t l = (size_t)u[0] << 24 | u[1] << 16 | u[2] << 8 | u[3];
+            if (n - 4 < l) return 0;
+            *skip = 4;
+            return l + 4;  // never 0
+        }
+        const char* e = (const char*)memchr(p, fmt == NUL ? 0 : '\n', n);
+        return e ? e - p + 1 : 0;
+    }
+
+    // Read more into buf, growing it when full; false at the end of input
+    bool fill() {
+        if (start > 0) {
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            start = 0;
+        }
+        if (end == cap) {
+            cap *= 2;
+            buf = (char*)realloc(buf, cap);
+            if (!buf) {
+                fprintf(stderr, "Out of memory for a record\n");
+                _Exit(1);
+            }
+        }
+        for (;;) {
+            ssize_t r = ::read(fd, buf + end, cap - end);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) {
+                perror("read");
+                _Exit(1);
+            }
+            end += r;
+            return r > 0;
+        }
+    }
+
+public:
+    RecordReader(int fd, Format format, bool complete_only = false, off_t offset = 0)
+        : fd(fd), fmt(format), complete_only(complete_only), map(NULL), size(0),
+          buf(NULL), cap(0), start(0), end(0), eof(false), pos(offset) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            size = st.st_size;
+            if (size > (size_t)offset && !complete_only) {
+                void* m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (m != MAP_FAILED) {
+                    madvise(m, size, MADV_SEQUENTIAL);
+                    map = (const char*)m;
+                    return;
+                }
+            }
+            if (lseek(fd, offset, SEEK_SET) < 0) {
+                perror("lseek");
+                _Exit(1);
+            }
+        } else if (offset) {
+            fprintf(stderr, "Can't start reading a pipe at an offset\n");
+            _Exit(1);
+        }
+        cap = 1 << 20;
+        buf = (char*)malloc(cap);
+    }
+
+    ~RecordReader() {
+        if (map) munmap((void*)map, size);
+        free(buf);
+    }
+
+    off_t offset() const { return pos; }
+
+    int read(const char** recs, size_t* lens, int n) {
+        int k = 0;
+        size_t skip;
+        if (map) {
+            for (; k < n && pos < size; ++k) {
+                size_t l = record(map + pos, size - pos, &skip);
+                if (!l) {
+                    if (complete_only) break;
+                    l = size - pos;
+                    skip = fmt == LENGTH && l >= 4 ? 4 : 0;
+                }
+                recs[k] = map + pos + skip;
+                lens[k] = l - skip;
+                pos += l;
+            }
+            return k;
+        }
+
+        start += offs.empty() ? 0 : offs.back();  // what the last read() returned
+        offs.clear();
+        size_t at = start;  // records are found at buf+at, offsets are from buf+start
+        for (; k < n; ++k) {
+            size_t l;
+            while (!(l = record(buf + at, end - at, &skip)) && !eof) {
+                size_t done = at - start;
+                eof = !fill();
+                at = start + done;
+            }
+            if (!l) {
+                if (at == end || complete_only) break;
+                l = end - at;
+                skip = fmt == LENGTH && l >= 4 ? 4 : 0;
+            }
+            offs.push_back(at - start + skip);
+            lens[k] = l - skip;
+            at += l;
+            pos += l;
+        }
+        for (int i = 0; i < k; ++i) recs[i] = buf + start + offs[i];
+        offs.push_back(at - start);
+        return k;
+    }
+
+    static void put(FILE* f, Format format, const char* head, size_t hl, const char* rec, size_t l) {
+        if (format == LENGTH) {
+            size_t n = hl + l;
+            unsigned char u[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16),
+                                   (unsigned char)(n >> 8), (unsigned char)n };
+            fwrite(u, 1, 4, f);
+        }
+        fwrite(head, 1, hl, f);
+        fwrite(rec, 1, l, f);
+    }
+
+    static int format(const char* name) {
+        if (!strcmp(name, "newline")) return NEWLINE;
+        if (!strcmp(name, "nul")) return NUL;
+        if (!strcmp(name, "length")) return LENGTH;
+        return -1;
+    }
+};
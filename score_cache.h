@@ -0,0 +1,58 @@
+#pragma once
+
+// A bounded cache of what scoring a line gave, for the modes that score
+// every line from the same template: an identical line gives the same
+// result, so it needn't go through the models again.
+//
+// ScoreCache<V> c(n) keeps up to n lines, dropping the least recently
+// used one when full (n=0 keeps none).
+// c.get(line, l, v) sets v to the result stored for the l bytes of line
+//     and returns true (a hit), or returns false (a miss).
+// c.put(line, l, v) stores v as the result for the line.
+// c.hits and c.misses count the outcomes of get().
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+template <class V>
+class ScoreCache {
+    typedef std::list<std::pair<std::string, V> > List;
+    List lru;  // most recently used first
+    std::unordered_map<std::string, typename List::iterator> index;
+    size_t capacity;
+public:
+    long hits, misses;
+
+    ScoreCache(size_t n): capacity(n), hits(0), misses(0) {}
+
+    bool get(const char* line, int l, V& v) {
+        auto it = index.find(std::string(line, l));
+        if (it == index.end()) {
+            ++misses;
+            return false;
+        }
+        ++hits;
+        lru.splice(lru.begin(), lru, it->second);
+        v = it->second->second;
+        return true;
+    }
+
+    void put(const char* line, int l, const V& v) {
+        if (!capacity) return;
+        std::string key(line, l);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            it->second->second = v;
+            lru.splice(lru.begin(), lru, it->second);
+            return;
+        }
+        if (lru.size() == capacity) {
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+        lru.push_front(std::make_pair(key, v));
+        index[key] = lru.begin();
+    }
+};
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bit_predictor.h"
+
+void quit(char const* m) {
+    fprintf(stderr, "%s\n", m);
+    _Exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4 || argc > 5 || argv[1][0] < '0' || argv[1][0] > '9' || argv[1][1]) {
+        fprintf(stderr, "Usage: shrinkstate N in.lpaq1state out.lpaq1state [--compact]\n"
+            "    Converts a saved predictor state to memory option N (0..9), so that a state\n"
+            "    trained with much memory can be used with \"lpaq1_stream N\" or classify on\n"
+            "    smaller nodes.  The hash table keeps the highest priority elements, the match\n"
+            "    model the most recent history that fits.  A larger N works too.\n");
+        return 1;
+    }
+
+    int MEM = 1 << (argv[1][0] - '0' + 20);
+
+    FILE* in = fopen(argv[2], "rb");
+    if (!in) quit("Can't open input state");
+    BitPredictor p(in);
+    fclose(in);
+
+    while (p.MEM() > MEM) p.shrink();
+    while (p.MEM() < MEM) p.grow();
+
+    FILE* out = fopen(argv[3], "wb");
+    if (!out) quit("Can't open output state");
+    if (argc == 5 && !strcmp(argv[4], "--compact")) p.save_compact(out);
+    else if (argc == 5) quit("Unknown option");
+    else p.save(out);
+    if (fclose(out)) quit("Can't write output state");
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+#!/bin/bash
+# Keyframe test: --join from right before each keyframe of a stream must
+# decode the rest of the input.  TARGET_MBPS makes the governor change the
+# level on some keyframe chunks, whose new level must not hide the 'K'.
+# Usage: ./test_join.sh file [N] [keyframe bytes] [MB/s]
+#     N is the memory option (default 0), keyframes every 100000 bytes and
+#     a target of 5 MB/s by default.
+
+set -e
+
+FILE="$1"
+MEM="${2:-0}"
+KEY="${3:-100000}"
+MBPS="${4:-5}"
+BIN="$(dirname "$0")/lpaq1_stream"
+TMP="${TMPDIR:-/tmp}/lpaq1_join.$$"
+
+if [ -z "$FILE" ]; then
+    echo "Usage: $0 file [N] [keyframe bytes] [MB/s]" >&2
+    exit 1
+fi
+
+trap 'rm -f "$TMP" "$TMP.out"' EXIT
+
+TARGET_MBPS=$MBPS KEYFRAME=$KEY "$BIN" $MEM -c < "$FILE" > "$TMP"
+"$BIN" $MEM -d < "$TMP" | cmp -s - "$FILE" || { echo "$FILE: -d differs" >&2; exit 1; }
+
+# Offsets of the 0xFF 0xFF ending each chunk that a 'K' follows, with an
+# 'L' in between as the level change used to be written
+OFFSETS=$(LC_ALL=C grep -obUaP '(?s)\xff\xff(\xfe\xffL.)?\xfe\xffK' "$TMP" | cut -d: -f1)
+
+N=0
+LAST=$(stat -c %s "$FILE")
+for O in $OFFSETS; do
+    tail -c +$((O + 1)) "$TMP" | "$BIN" $MEM --join > "$TMP.out"
+    SIZE=$(stat -c %s "$TMP.out")
+    # each keyframe starts later in the input than the one before
+    if [ "$SIZE" -ge "$LAST" ] || ! tail -c "$SIZE" "$FILE" | cmp -s - "$TMP.out"; then
+        echo "$FILE: --join at byte $O of the stream gives the wrong output" >&2
+        exit 1
+    fi
+    LAST=$SIZE
+    N=$((N + 1))
+done
+echo "$FILE: $N keyframes, --join ok at each"
@@ -0,0 +1,132 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bit_predictor.h"
+#include "predictor_pool.h"
+#include "record_reader.h"
+
+void quit(char const* m) {
+    fprintf(stderr, "%s\n", m);
+    _Exit(1);
+}
+
+enum Format { RAW, COMPACT, PERSIST };
+
+struct Class {
+    std::string label;
+    std::string text;  // the lines of this class, in input order
+};
+
+// Whether prefix<label>.lpaq1state names a file in the directory of prefix
+bool valid_label(const std::string& prefix, const std::string& label) {
+    size_t dir = prefix.rfind('/');
+    size_t name = prefix.size() - (dir == std::string::npos ? 0 : dir + 1) + label.size() + strlen(".lpaq1state");
+    return !label.empty() && label.find('/') == std::string::npos
+        && label.find('\0') == std::string::npos && name <= NAME_MAX;
+}
+
+// Train the state of one class and write it to path, with a predictor
+// from pool if there is one
+void build(const Class& c, int MEM, Format format, const std::string& path, PredictorPool* pool) {
+    BitPredictor* p = pool ? pool->acquire() : new BitPredictor(MEM);
+    for (size_t j = 0; j < c.text.size(); j += 1 << 30)
+        p->update_bytes(c.text.data() + j, std::min(c.text.size() - j, (size_t)1 << 30));
+
+    if (format == PERSIST) {
+        unlink(path.c_str());  // an existing file would replace the state
+        p->persist(path.c_str());
+        p->sync();
+    } else {
+        FILE* out = fopen(path.c_str(), "wb");
+        if (!out) quit("Can't open output state");
+        if (format == COMPACT) p->save_compact(out);
+        else p->save(out);
+        if (fclose(out)) quit("Can't write output state");
+    }
+    if (pool) pool->release(p);
+    else delete p;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4 || argc > 6 || argv[1][0] < '0' || argv[1][0] > '9' || argv[1][1] || atoi(argv[2]) < 1) {
+        fprintf(stderr, "Usage: trainclasses N threads prefix [--compact|--persist] [--pool=n[:MB]] < labelled.txt\n"
+            "    Reads lines \"label<TAB>text\" and trains one predictor per label with\n"
+            "    memory option N (0..9) on the text of its lines (with the newline), as\n"
+            "    \"SAVE=prefix<label>.lpaq1state lpaq1_stream N -c\" would on a file of them.\n"
+            "    The classes are trained by a pool of threads, and all the states are\n"
+            "    written to prefix<label>.lpaq1state for classify: the raw format, the\n"
+            "    compact one, or memory mapped files for \"PERSIST=\".\n"
+            "    --pool keeps n fresh predictors ready, made and reset on a background\n"
+            "    thread, with at most MB megabytes of them in all (not with --persist).\n");
+        return 1;
+    }
+
+    int MEM = 1 << (argv[1][0] - '0' + 20);
+    int threads = atoi(argv[2]);
+    std::string prefix = argv[3];
+    Format format = RAW;
+    int pool_size = 0, pool_mb = 0;
+    for (int i = 4; i < argc; ++i) {
+        if (!strcmp(argv[i], "--compact")) format = COMPACT;
+        else if (!strcmp(argv[i], "--persist")) format = PERSIST;
+        else if (sscanf(argv[i], "--pool=%d:%d", &pool_size, &pool_mb) < 1 || pool_size < 1 || pool_mb < 0)
+            quit("Unknown option");
+    }
+    if (pool_size && format == PERSIST) quit("--pool can't be used with --persist");
+
+    std::vector<Class> classes;
+    std::map<std::string, int> index;  // label -> classes[]
+    RecordReader reader(0, RecordReader::NEWLINE);
+    const char* lines[256];
+    size_t lens[256];
+    for (int n; (n = reader.read(lines, lens, 256)) > 0; ) {
+        for (int j = 0; j < n; ++j) {
+            const char* tab = (const char*)memchr(lines[j], '\t', lens[j]);
+            if (!tab) quit("Line without a label");
+            std::string label(lines[j], tab - lines[j]);
+            if (!valid_label(prefix, label)) quit("Bad label");
+
+            auto it = index.find(label);
+            if (it == index.end()) {
+                it = index.insert(std::make_pair(label, int(classes.size()))).first;
+                classes.push_back(Class());
+                classes.back().label = label;
+            }
+            classes[it->second].text.append(tab + 1, lines[j] + lens[j]);
+        }
+    }
+
+    BitPredictor* fresh = NULL;
+    PredictorPool* pool = NULL;
+    if (pool_size) {
+        fresh = new BitPredictor(MEM);
+        pool = new PredictorPool(*fresh, pool_size, (size_t)pool_mb << 20);
+    }
+    
+    // Each worker takes the next class until there are none left
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int k; (k = next++) < int(classes.size()); )
+            build(classes[k], MEM, format, prefix + classes[k].label + ".lpaq1state", pool);
+    };
+    if (threads > int(classes.size())) threads = classes.size();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; ++i)
+        workers.push_back(std::thread(work));
+    for (auto& t : workers)
+        t.join();
+    delete pool;
+
+    for (auto& c : classes)
+        fprintf(stderr, "%s%s.lpaq1state: %zu bytes\n", prefix.c_str(), c.label.c_str(), c.text.size());
+    return 0;
+}
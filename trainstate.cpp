@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+#include "bit_predictor.h"
+
+void quit(char const* m) {
+    fprintf(stderr, "%s\n", m);
+    _Exit(1);
+}
+
+// Feed n bytes to p, most significant bit first, as the compressor does
+void train(BitPredictor* p, const unsigned char* buf, size_t n) {
+    for (size_t j = 0; j < n; j += 1 << 30)
+        p->update_bytes((const char*)buf + j, std::min(n - j, (size_t)1 << 30));
+}
+
+unsigned char* read_all(FILE* f, size_t& size) {
+    size_t cap = 1 << 20;
+    unsigned char* buf = (unsigned char*)malloc(cap);
+    size = 0;
+    for (;;) {
+        if (!buf) quit("Out of memory");
+        size_t n = fread(buf + size, 1, cap - size, f);
+        size += n;
+        if (size < cap) break;
+        cap *= 2;
+        buf = (unsigned char*)realloc(buf, cap);
+    }
+    return buf;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4 || argc > 5 || argv[1][0] < '0' || argv[1][0] > '9' || argv[1][1] || atoi(argv[2]) < 1) {
+        fprintf(stderr, "Usage: trainstate N threads out.lpaq1state [--compact] < corpus\n"
+            "    Trains a predictor state for memory option N (0..9) on the corpus, like\n"
+            "    \"SAVE=out.lpaq1state lpaq1_stream N -c\", on several threads: the corpus\n"
+            "    is split at line ends into one part per thread, each part trains its own\n"
+            "    model and the models are merged.  Uses threads+1 times the memory of one\n"
+            "    model and compresses slightly worse than a state trained in one piece.\n");
+        return 1;
+    }
+
+    int MEM = 1 << (argv[1][0] - '0' + 20);
+    int threads = atoi(argv[2]);
+    bool compact = false;
+    if (argc == 5 && !strcmp(argv[4], "--compact")) compact = true;
+    else if (argc == 5) quit("Unknown option");
+
+    size_t size;
+    unsigned char* buf = read_all(stdin, size);
+
+    // Part k is buf[start[k]..start[k+1])
+    size_t* start = new size_t[threads + 1];
+    start[0] = 0;
+    start[threads] = size;
+    for (int k = 1; k < threads; ++k) {
+        size_t s = size / threads * k;
+        if (s < start[k - 1]) s = start[k - 1];
+        while (s > 0 && s < size && buf[s - 1] != '\n') ++s;
+        start[k] = s;
+    }
+
+    BitPredictor** parts = new BitPredictor*[threads];
+    std::thread* workers = new std::thread[threads];
+    for (int k = 0; k < threads; ++k) {
+        parts[k] = new BitPredictor(MEM);
+        workers[k] = std::thread(train, parts[k], buf + start[k], start[k + 1] - start[k]);
+    }
+    for (int k = 0; k < threads; ++k)
+        workers[k].join();
+
+    BitPredictor* p = parts[0];
+    if (threads > 1) {
+        p = new BitPredictor(MEM);
+        p->merge(parts, threads);
+    }
+
+    FILE* out = fopen(argv[3], "wb");
+    if (!out) quit("Can't open output state");
+    if (compact) p->save_compact(out);
+    else p->save(out);
+    if (fclose(out)) quit("Can't write output state");
+
+    return 0;
+}